@@ -0,0 +1,16 @@
+#ifndef MMAN_H
+#define MMAN_H
+
+// memory protection flags of mmap and mprotect, shared by kernel and user
+
+#define PROT_NONE   0
+#define PROT_READ   1
+#define PROT_WRITE  2
+#define PROT_EXEC   4
+
+// flags of mmap
+#define MAP_HUGE    1   // back with 2M pages, first touch commits 2M
+
+#define MAP_FAILED  ((void *) -1)
+
+#endif // MMAN_H
@@ -48,6 +48,85 @@ static __INIT void parse_madt(madt_t * tbl) {
     }
 }
 
+//------------------------------------------------------------------------------
+// parse srat and slit table, find numa node of each cpu and memory range
+
+// proximity domain of each numa node
+static __INITDATA u32 node_domains[MAX_NODE_COUNT];
+static __INITDATA int node_found = 0;
+
+// map proximity domain to node index, return -1 if too many nodes
+static __INIT int find_node(u32 domain, int create) {
+    for (int i = 0; i < node_found; ++i) {
+        if (node_domains[i] == domain) {
+            return i;
+        }
+    }
+    if ((!create) || (node_found >= MAX_NODE_COUNT)) {
+        return -1;
+    }
+    node_domains[node_found] = domain;
+    return node_found++;
+}
+
+static __INIT void parse_srat(srat_t * tbl) {
+    u8 * end = (u8 *) tbl + tbl->header.length;
+    u8 * p   = (u8 *) tbl + sizeof(srat_t);
+
+    while (p < end) {
+        acpi_subtbl_t * sub = (acpi_subtbl_t *) p;
+        int node = -1;
+        switch (sub->type) {
+        case SRAT_TYPE_LOCAL_APIC: {
+            srat_loapic_t * cpu = (srat_loapic_t *) sub;
+            u32 domain = (u32) cpu->domain_lo
+                       | ((u32) cpu->domain_hi[0] <<  8)
+                       | ((u32) cpu->domain_hi[1] << 16)
+                       | ((u32) cpu->domain_hi[2] << 24);
+            if ((cpu->flags & SRAT_ENABLED) &&
+                (-1 != (node = find_node(domain, YES)))) {
+                loapic_set_node(cpu->apic_id, node);
+            }
+            break;
+        }
+        case SRAT_TYPE_MEMORY: {
+            srat_memory_t * mem = (srat_memory_t *) sub;
+            if ((mem->flags & SRAT_ENABLED) &&
+                (-1 != (node = find_node(mem->domain, YES)))) {
+                dbg_print("+ node %d 0x%08llx-0x%08llx.\n",
+                          node, mem->base, mem->base + mem->length);
+                page_node_add(node, mem->base, mem->base + mem->length);
+            }
+            break;
+        }
+        case SRAT_TYPE_LOCAL_X2APIC: {
+            srat_x2apic_t * cpu = (srat_x2apic_t *) sub;
+            if ((cpu->flags & SRAT_ENABLED) && (cpu->x2apic_id < 256) &&
+                (-1 != (node = find_node(cpu->domain, YES)))) {
+                loapic_set_node(cpu->x2apic_id, node);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        p += sub->length;
+    }
+}
+
+static __INIT void parse_slit(slit_t * tbl) {
+    u64 count = tbl->count;
+    for (u64 i = 0; i < count; ++i) {
+        for (u64 j = 0; j < count; ++j) {
+            int from = find_node((u32) i, NO);
+            int to   = find_node((u32) j, NO);
+            if ((-1 != from) && (-1 != to)) {
+                page_node_dist(from, to, tbl->entries[i * count + j]);
+            }
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 // parse physical memory map
 
@@ -66,17 +145,29 @@ static __INIT void parse_mmap(u8 * mmap_buf, u32 mmap_len) {
     page_array = (page_t *) v_end;
     page_count = 0;
 
-    // walk through the memory layout table, fill invalid entries of page array
+    // walk through the memory layout table, find out number of pages
     mb_mmap_item_t * map_end = (mb_mmap_item_t *) (mmap_buf + mmap_len);
     for (mb_mmap_item_t * item = (mb_mmap_item_t *) mmap_buf; item < map_end;) {
         pfn_t start = (item->addr + PAGE_SIZE - 1) >> PAGE_SHIFT;
         pfn_t end   = (item->addr + item->len)     >> PAGE_SHIFT;
         if ((start < end) && (MB_MEMORY_AVAILABLE == item->type)) {
-            for (; page_count < start; ++page_count) {
-                page_array[page_count].type = PT_INVALID;
+            page_count = MAX(page_count, end);
+        }
+        item = (mb_mmap_item_t *) ((u64) item + item->size + sizeof(item->size));
+    }
+
+    // only fill page array entries needed for booting, rest are deferred
+    pfn_t boot_end = page_defer_setup(virt_to_phys(&page_array[page_count]));
+    pfn_t pfn      = 0;
+    for (mb_mmap_item_t * item = (mb_mmap_item_t *) mmap_buf; item < map_end;) {
+        pfn_t start = (item->addr + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        pfn_t end   = (item->addr + item->len)     >> PAGE_SHIFT;
+        if ((start < end) && (MB_MEMORY_AVAILABLE == item->type)) {
+            for (; (pfn < start) && (pfn < boot_end); ++pfn) {
+                page_array[pfn].type = PT_INVALID;
             }
-            for (; page_count < end; ++page_count) {
-                page_array[page_count].type = PT_KERNEL;
+            for (; (pfn < end) && (pfn < boot_end); ++pfn) {
+                page_array[pfn].type = PT_KERNEL;
             }
         }
         item = (mb_mmap_item_t *) ((u64) item + item->size + sizeof(item->size));
@@ -101,6 +192,27 @@ static __INIT void parse_mmap(u8 * mmap_buf, u32 mmap_len) {
     }
 }
 
+//------------------------------------------------------------------------------
+// boot phase timing
+
+static __INITDATA u64 phase_tsc;    // end of last phase
+static __INITDATA u64 defer_tsc;    // start of deferred page init
+
+static __INIT void phase_done(const char * name) {
+    u64 now = read_tsc();
+    dbg_print("~ %s took %llu kcycles.\n", name, (now - phase_tsc) / 1000);
+    phase_tsc = now;
+}
+
+// run on every cpu, the one finishing the last section reports time
+static void defer_proc() {
+    if (YES == page_defer_run()) {
+        u64 now = read_tsc();
+        dbg_print("~ deferred page init took %llu kcycles, %llu pages free.\n",
+                  (now - defer_tsc) / 1000, free_page_count(ZONE_DMA|ZONE_NORMAL));
+    }
+}
+
 //------------------------------------------------------------------------------
 // pre-kernel initialization routines
 
@@ -111,6 +223,7 @@ static __INITDATA mb_info_t mbi;
 static void root_proc();
 
 __INIT __NORETURN void sys_init_bsp(u32 ebx) {
+    phase_tsc = read_tsc();
     serial_dev_init();
     console_dev_init();
     dbg_print("wheel operating system starting up.\n");
@@ -151,9 +264,16 @@ __INIT __NORETURN void sys_init_bsp(u32 ebx) {
     acpi_tbl_init();
     parse_madt(acpi_madt);
 
-    // init page frame allocator, requires multicore info
+    // init page frame allocator, requires multicore and numa info
     page_lib_init();
+    if (NULL != acpi_srat) {
+        parse_srat(acpi_srat);
+    }
+    if (NULL != acpi_slit) {
+        parse_slit(acpi_slit);
+    }
     parse_mmap(mmap_buf, mmap_len);
+    phase_done("acpi and memory map");
 
     // init essential cpu functions
     dbg_regist(symtab, sym_size, strtab, str_size);
@@ -162,6 +282,7 @@ __INIT __NORETURN void sys_init_bsp(u32 ebx) {
     idt_init();
     tss_init();
     write_gsbase(percpu_base);
+    page_cache_init();
 
     // init interrupt handling
     int_init();
@@ -169,13 +290,17 @@ __INIT __NORETURN void sys_init_bsp(u32 ebx) {
     loapic_dev_init();
 
     // create and switch to kernel page table
-    kernel_ctx_init();
+    kernel_ctx_init(mmap_buf, mmap_len);
+    phase_done("cpu and page table");
 
     // init core kernel features
+    pool_lib_init();
+    kmalloc_lib_init();
     work_lib_init();
     tick_lib_init();
     task_lib_init();
     sched_lib_init();
+    phase_done("core kernel");
 
     // dummy tcb, allocated on stack
     task_t tcb_temp = { .priority = PRIORITY_IDLE + 1 };
@@ -260,9 +385,26 @@ static void root_proc() {
             tick_delay(10);
         }
     }
+    phase_done("ap startup");
+
+    // deferred page descriptors are initialized on all cpus in parallel
+    // root task joins them, and the rest of memory is used lazily
+    defer_tsc = phase_tsc;
+    for (int i = 1; i < cpu_activated; ++i) {
+        task_resume(task_create("pginit", PRIORITY_NONRT, defer_proc, 0,0,0,0));
+    }
+    defer_proc();
+
+    // start reclaiming memory in background
+    page_reclaim_init();
+
+#ifdef POOL_BENCH
+    pool_bench();
+#endif
 
     // initialize the rest of kernel features
     vmspace_lib_init();
+    shm_lib_init();
     process_lib_init();
     syscall_lib_init();
 
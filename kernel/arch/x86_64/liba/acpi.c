@@ -12,11 +12,17 @@
                  | ((u32) 'E' << 16) | ((u32) 'T' << 24) )
 #define SIG_FADT ( ((u32) 'F' <<  0) | ((u32) 'A' <<  8) \
                  | ((u32) 'C' << 16) | ((u32) 'P' << 24) )
+#define SIG_SRAT ( ((u32) 'S' <<  0) | ((u32) 'R' <<  8) \
+                 | ((u32) 'A' << 16) | ((u32) 'T' << 24) )
+#define SIG_SLIT ( ((u32) 'S' <<  0) | ((u32) 'L' <<  8) \
+                 | ((u32) 'I' << 16) | ((u32) 'T' << 24) )
 
 madt_t * acpi_madt = NULL;
 mcfg_t * acpi_mcfg = NULL;
 fadt_t * acpi_fadt = NULL;
 hpet_t * acpi_hpet = NULL;
+srat_t * acpi_srat = NULL;
+slit_t * acpi_slit = NULL;
 
 static __INIT u8 calc_tbl_checksum(acpi_tbl_t * header) {
     u8 * end = (u8 *) header + header->length;
@@ -31,6 +37,8 @@ static __INIT void store_acpi_tbl(acpi_tbl_t * tbl) {
     case SIG_MCFG: acpi_mcfg = (mcfg_t *) tbl; break;
     case SIG_HPET: acpi_hpet = (hpet_t *) tbl; break;
     case SIG_FADT: acpi_fadt = (fadt_t *) tbl; break;
+    case SIG_SRAT: acpi_srat = (srat_t *) tbl; break;
+    case SIG_SLIT: acpi_slit = (slit_t *) tbl; break;
     default:                                   break;
     }
 }
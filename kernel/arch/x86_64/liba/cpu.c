@@ -60,6 +60,7 @@ volatile   int cpu_activated = 0;  // number of cpu activated
 __PERCPU   int int_depth;
 __PERCPU   u64 int_rsp;
 __PERCPU   u8  int_stk[16*PAGE_SIZE];
+__PERCPU   int cpu_node;           // numa node of this cpu
 
 // interrupt service routines
 isr_proc_t isr_tbl[VEC_NUM_COUNT];
@@ -79,13 +80,22 @@ extern void load_tr  (u16 sel);
 static __INITDATA int support_fsgsbase = 0;
 static __INITDATA int support_erms     = 0;
 static __INITDATA int support_noexec   = 0;
+int                   support_pcid     = 0;    // process context identifier
+int                   support_invpcid  = 0;
+int                   support_1gpage   = 0;    // 1G pages in PDP entries
 
 __INIT void cpu_init() {
     u32 a, b, c, d;
 
     if (0 == cpu_activated) {
+        // numa node of each cpu is known after parsing srat
+        for (int i = 0; i < cpu_installed; ++i) {
+            percpu_var(i, cpu_node) = loapic_get_node(i);
+        }
+
         a = 1;
         cpuid(&a, &b, &c, &d);
+        support_pcid = (c & (1U << 17)) ? 1 : 0;
         if (c & (1U <<  0)) { /*dbg_print(", sse3");*/       }
         if (c & (1U <<  9)) { /*dbg_print(", ssse3");*/      }
         if (c & (1U << 19)) { /*dbg_print(", sse4.1");*/     }
@@ -101,11 +111,13 @@ __INIT void cpu_init() {
         cpuid(&a, &b, &c, &d);
         support_fsgsbase = (b & (1U << 0)) ? 1 : 0;
         support_erms     = (b & (1U << 9)) ? 1 : 0;
+        support_invpcid  = (b & (1U << 10)) ? 1 : 0;
 
         // check extended processor info and feature bits
         a = 0x80000001;
         cpuid(&a, &b, &c, &d);
         support_noexec = (d & (1U << 20)) ? 1 : 0;  // NX bit in page entries
+        support_1gpage = (d & (1U << 26)) ? 1 : 0;  // 1G pages
     }
 
     u64 cr0 = read_cr0();
@@ -119,6 +131,14 @@ __INIT void cpu_init() {
     // cr4 |= (1UL << 16);         // FSGSBASE, enable wrfsbase/wrgsbase in ring3
     // write_cr4(cr4);
 
+    // kernel space is mapped global, kept across cr3 reload
+    write_cr4(read_cr4() | (1UL << 7));         // cr4.PGE
+
+    // tag TLB entries with pcid, cr3 has no pcid bits yet
+    if (support_pcid) {
+        write_cr4(read_cr4() | (1UL << 17));    // cr4.PCIDE
+    }
+
     // enable No-Execute bit in page entries
     u64 efer = read_msr(0xc0000080);
     efer |= (1UL <<  0);        // enable syscall/sysret on intel processors
@@ -226,6 +246,27 @@ static void exp_default(int vec, int_frame_t * f) {
     while (1) {}
 }
 
+// not-present page or write to shared page in user space, try demand
+// paging or copy-on-write in current process
+// this also covers kernel accessing user buffers during syscalls
+// fault may wait for TLB shootdown, so interrupt is enabled if it was
+// enabled in faulting code, other cpus could then flush and wait for us
+static void exp_page_fault(int vec, int_frame_t * f) {
+    usize    va      = read_cr2();
+    int      present = (0 != (f->errcode & 1));
+    int      write   = (0 != (f->errcode & 2));
+    task_t * tid     = thiscpu_var(tid_prev);
+    if ((!present || write) && (va < USER_END) && (NULL != tid->process)) {
+        int_unlock((u32) f->rflags & 0x200);
+        int ret = vmspace_fault(&tid->process->vm, va, write);
+        int_lock();
+        if (OK == ret) {
+            return;
+        }
+    }
+    exp_default(vec, f);
+}
+
 static void int_default(int vec, int_frame_t * f __UNUSED) {
     dbg_print("INT#%x!\n", vec);
     while (1) {}
@@ -240,6 +281,7 @@ __INIT void int_init() {
     for (int i = 0; i < 32; ++i) {
         isr_tbl[i] = exp_default;
     }
+    isr_tbl[14] = exp_page_fault;
     for (int i = 32; i < VEC_NUM_COUNT; ++i) {
         isr_tbl[i] = int_default;
     }
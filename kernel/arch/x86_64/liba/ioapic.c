@@ -130,6 +130,7 @@ __INIT void ioapic_dev_add(madt_ioapic_t * tbl) {
         ioapic_devs[ioapic_count].id        = tbl->id;
         ioapic_devs[ioapic_count].addr      = tbl->address;
         ioapic_devs[ioapic_count].gsi_start = tbl->global_irq_base;
+        kernel_ctx_add_io(tbl->address, PAGE_SIZE);
         ++ioapic_count;
     }
 }
@@ -66,6 +66,7 @@
 typedef struct loapic {
     u8 apic_id;
     u8 processor_id;
+    u8 node;
 } loapic_t;
 
 static u64  loapic_addr   = 0;
@@ -87,7 +88,7 @@ static void loapic_resched_proc(int vec, int_frame_t * sp __UNUSED) {
 
 static void loapic_flushmmu_proc(int vec, int_frame_t * sp __UNUSED) {
     dbg_assert(vec == VECNUM_FLUSHMMU);
-    // TODO: clear all tlb entries
+    mmu_flush_proc();
     loapic_send_eoi();
 }
 
@@ -113,6 +114,10 @@ void loapic_send_eoi() {
     write32(loapic_base + LOAPIC_EOI, 0);
 }
 
+int loapic_get_node(int cpu) {
+    return loapic_devs[cpu].node;
+}
+
 void loapic_emit_ipi(int cpu, int vec) {
     u32 icr_hi = ((u32) loapic_devs[cpu].apic_id << 24) & 0xff000000;
     u32 icr_lo = (vec & 0xff) | LOAPIC_FIXED | LOAPIC_EDGE | LOAPIC_DEASSERT;
@@ -127,6 +132,7 @@ void loapic_emit_ipi(int cpu, int vec) {
 __INIT void loapic_override(u64 addr) {
     loapic_addr = addr;
     loapic_base = (u8 *) phys_to_virt(addr);
+    kernel_ctx_add_io(addr, PAGE_SIZE);
 }
 
 // register a local apic instance
@@ -134,10 +140,20 @@ __INIT void loapic_dev_add(madt_loapic_t * tbl) {
     if (cpu_installed < MAX_CPU_COUNT) {
         loapic_devs[cpu_installed].apic_id      = tbl->id;
         loapic_devs[cpu_installed].processor_id = tbl->processor_id;
+        loapic_devs[cpu_installed].node         = 0;
         ++cpu_installed;
     }
 }
 
+// set numa node of the cpu with given apic id
+__INIT void loapic_set_node(u32 apic_id, int node) {
+    for (int i = 0; i < cpu_installed; ++i) {
+        if (loapic_devs[i].apic_id == apic_id) {
+            loapic_devs[i].node = (u8) node;
+        }
+    }
+}
+
 // TODO: set LINT0 and LINT1
 __INIT void loapic_set_nmi(madt_loapic_mni_t * tbl __UNUSED) {
     //
@@ -1,9 +1,26 @@
 #include <wheel.h>
 
 // currently we don't support shared page (sub) tables
-// when virtual address is unmapped, its page tables are not free-ed
-// the empty page table remains in memory
-// ADDR field indicates if the table is allocated
+// each PDP, PD and PT counts its present entries in `page.entries`, an
+// entry is either zero or present. when a table of user space becomes
+// empty during unmap, it is freed and the upper entry is cleared.
+// tables of kernel space are shared by all contexts, never freed.
+//
+// map and unmap walk the range level by level, each table is visited
+// once. a 2M page partially remapped or unmapped is split into 4K first.
+//
+// stale TLB entries are collected in a batch during map and unmap, and
+// flushed on every cpu that has the context loaded or cached. freed page
+// tables are only returned after all cpus have flushed. callers changing
+// page tables under a spinlock pass their own batch and flush it after
+// the lock is dropped, waiting for other cpus with the lock held could
+// deadlock with cpus spinning for it with interrupt disabled.
+//
+// if PCID is supported, each cpu tags recently used contexts with pcid,
+// so TLB entries survive context switch. a context cached but not loaded
+// gets its entries invalidated by INVPCID, or loses its pcid if INVPCID is
+// not supported, and is then flushed when loaded again. kernel space is
+// shared, so its changes are invalidated in every pcid tagged on the cpu.
 // TODO: do we need an arch-dependent struct that describes page table attrs?
 
 // different fields of virtual memory address
@@ -28,9 +45,36 @@
 #define MMU_PAT_4K  0x0000000000000080UL    // (PAT) for 4K PTE
 #define MMU_PAT_2M  0x0000000000001000UL    // (PAT) for 2M PDE
 
+// bits changed by `mmu_protect`
+#define MMU_PROT    (MMU_NX | MMU_US | MMU_RW)
+
+// bits of cr3 when PCID enabled
+#define CR3_PCID    0x0000000000000fffUL    // process context identifier
+#define CR3_NOFLUSH 0x8000000000000000UL    // keep TLB entries of this pcid
+
+// flush requests posted to a cpu, each address with its context
+typedef struct flush_req {
+    spin_t lock;
+    u32    count;                   // greater than FLUSH_BATCH means all
+    u32    seq;                     // number of requests posted
+    u32    done;                    // number of requests finished
+    usize  drop;                    // context being destroyed, or 0
+    usize  ctxs [FLUSH_BATCH];
+    usize  addrs[FLUSH_BATCH];
+} flush_req_t;
+
+// pcid 0 is never used, cr3 starts with it before pcid is enabled
+#define PCID_COUNT  8
+
 // contains mapping for kernel space
 usize kernel_ctx = 0UL;
 
+// context in cr3, pcid bits are not included
+__PERCPU usize mmu_loaded;
+static __PERCPU flush_req_t flush_req;
+static __PERCPU usize       pcid_ctx[PCID_COUNT];  // context tagged by pcid
+static __PERCPU u32         pcid_next;             // next pcid to recycle
+
 // defined in `layout.ld`
 extern u8 _init_end;
 extern u8 _text_end;
@@ -38,112 +82,737 @@ extern u8 _rodata_end;
 extern u8 _kernel_end;
 
 //------------------------------------------------------------------------------
-// private functions for creating page entry
+// TLB shootdown
 
-// create a 4k mapping entry in the page table
-static void mmu_map_4k(usize ctx, u64 va, u64 pa, u64 fields) {
-    u64 pte   = (va >> 12) & 0x01ff;    // index of page-table entry
-    u64 pde   = (va >> 21) & 0x01ff;    // index of page-directory entry
-    u64 pdpe  = (va >> 30) & 0x01ff;    // index of page-directory-pointer entry
-    u64 pml4e = (va >> 39) & 0x01ff;    // index of page-map level-4 entry
+static void batch_add(mmu_batch_t * batch, usize va) {
+    if (batch->count < FLUSH_BATCH) {
+        batch->addrs[batch->count] = va;
+    }
+    if (batch->count <= FLUSH_BATCH) {
+        ++batch->count;
+    }
+}
 
-    // PML4 table is always present
-    u64 * pml4 = (u64 *) phys_to_virt(ctx);
+// pcid of the context on this cpu, 0 if not tagged
+static u32 pcid_of(usize ctx) {
+    usize * tags = thiscpu_var(pcid_ctx);
+    for (int i = 1; i < PCID_COUNT; ++i) {
+        if (tags[i] == ctx) {
+            return i;
+        }
+    }
+    return 0;
+}
 
-    // check if PDP is present
-    if (0 == (pml4[pml4e] & MMU_ADDR)) {
-        pfn_t pfn   = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        pml4[pml4e] = ((u64) pfn << PAGE_SHIFT) & MMU_ADDR;
-        memset(phys_to_virt((u64) pfn << PAGE_SHIFT), 0, PAGE_SIZE);
+// check whether `ctx` is tagged by pcid on `cpu`
+static int pcid_cached(int cpu, usize ctx) {
+    usize * tags = percpu_var(cpu, pcid_ctx);
+    for (int i = 1; i < PCID_COUNT; ++i) {
+        if (tags[i] == ctx) {
+            return YES;
+        }
     }
-    pml4[pml4e] |= MMU_US| MMU_RW | MMU_P;
-    u64 * pdp = (u64 *) phys_to_virt(pml4[pml4e] & MMU_ADDR);
+    return NO;
+}
 
-    // check if PD is present
-    if (0 == (pdp[pdpe] & MMU_ADDR)) {
-        pfn_t pfn = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        pdp[pdpe] = ((u64) pfn << PAGE_SHIFT) & MMU_ADDR;
-        memset(phys_to_virt((u64) pfn << PAGE_SHIFT), 0, PAGE_SIZE);
+// forget pcid of the context, unless it is loaded
+static void pcid_drop(usize ctx) {
+    usize * tags = thiscpu_var(pcid_ctx);
+    for (int i = 1; i < PCID_COUNT; ++i) {
+        if ((tags[i] == ctx) && (ctx != thiscpu_var(mmu_loaded))) {
+            tags[i] = 0;
+        }
     }
-    pdp[pdpe] |= MMU_US| MMU_RW | MMU_P;
-    u64 * pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
+}
 
-    // check if page table is present
-    if (0 == (pd[pde] & MMU_ADDR)) {
-        pfn_t pfn = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        pd[pde]   = ((u64) pfn << PAGE_SHIFT) & MMU_ADDR;
-        memset(phys_to_virt((u64) pfn << PAGE_SHIFT), 0, PAGE_SIZE);
+// invalidate TLB entries of `ctx` on this cpu, interrupt disabled
+static void tlb_flush(usize ctx, u32 count, usize * addrs) {
+    usize loaded = thiscpu_var(mmu_loaded);
+
+    if (count > FLUSH_BATCH) {
+        // toggling PGE flushes all entries, global or of any pcid
+        u64 cr4 = read_cr4();
+        write_cr4(cr4 & ~(1UL << 7));
+        write_cr4(cr4);
+        return;
     }
-    pd[pde] |= MMU_US| MMU_RW | MMU_P;
-    u64 * pt = (u64 *) phys_to_virt(pd[pde] & MMU_ADDR);
 
-    // fill the final entry
-    pt[pte] = (pa & MMU_ADDR) | fields | MMU_P;
+    if (ctx == kernel_ctx) {
+        // kernel pages are global, invlpg removes them regardless of pcid
+        // but paging-structure caches of other pcids may still refer to
+        // freed kernel page tables, invalidate them too, or drop the tag
+        usize * tags = thiscpu_var(pcid_ctx);
+        for (u32 i = 0; i < count; ++i) {
+            ASM("invlpg (%0)" :: "r"(addrs[i]) : "memory");
+        }
+        for (int pcid = 1; pcid < PCID_COUNT; ++pcid) {
+            if ((0 == tags[pcid]) || (tags[pcid] == loaded)) {
+                continue;
+            }
+            if (support_invpcid) {
+                for (u32 i = 0; i < count; ++i) {
+                    invpcid_addr(pcid, addrs[i]);
+                }
+            } else {
+                tags[pcid] = 0;
+            }
+        }
+    } else if (ctx == loaded) {
+        for (u32 i = 0; i < count; ++i) {
+            ASM("invlpg (%0)" :: "r"(addrs[i]) : "memory");
+        }
+    } else {
+        // keep other entries of the context if we could
+        u32 pcid = pcid_of(ctx);
+        if (support_invpcid && (0 != pcid)) {
+            for (u32 i = 0; i < count; ++i) {
+                invpcid_addr(pcid, addrs[i]);
+            }
+        } else {
+            pcid_drop(ctx);
+        }
+    }
+}
+
+// handle flush requests posted to this cpu, called by `VECNUM_FLUSHMMU`
+// request lock is taken with interrupt disabled, so isr could use it too
+void mmu_flush_proc() {
+    flush_req_t * req = thiscpu_ptr(flush_req);
+    usize         ctxs [FLUSH_BATCH];
+    usize         addrs[FLUSH_BATCH];
 
-    // clear TLB entry
-    if (read_cr3() == ctx) {
-        ASM("invlpg (%0)" :: "r"(va));
+    u32 key = int_lock();
+    raw_spin_take(&req->lock);
+    u32   count = req->count;
+    u32   seq   = req->seq;
+    usize drop  = req->drop;
+    if (count <= FLUSH_BATCH) {
+        memcpy(ctxs,  req->ctxs,  count * sizeof(usize));
+        memcpy(addrs, req->addrs, count * sizeof(usize));
+    }
+    req->count = 0;
+    req->drop  = 0;
+    raw_spin_give(&req->lock);
+
+    if (0 != drop) {
+        // loaded by a kernel task, switch away before it is freed
+        // physical page might be reused by new context, drop its pcid
+        if (thiscpu_var(mmu_loaded) == drop) {
+            mmu_ctx_set(kernel_ctx);
+        }
+        pcid_drop(drop);
+    }
+    if (count > FLUSH_BATCH) {
+        tlb_flush(0, count, NULL);
+    } else {
+        for (u32 i = 0; i < count; ++i) {
+            tlb_flush(ctxs[i], 1, &addrs[i]);
+        }
     }
+    int_unlock(key);
+
+    atomic32_set(&req->done, seq);
 }
 
-// create a 2m mapping entry in the page table
-static void mmu_map_2m(usize ctx, u64 va, u64 pa, u64 fields) {
-    u64 pde   = (va >> 21) & 0x01ff;    // index of page-directory entry
-    u64 pdpe  = (va >> 30) & 0x01ff;    // index of page-directory-pointer entry
-    u64 pml4e = (va >> 39) & 0x01ff;    // index of page-map level-4 entry
+// serve pending flush requests while waiting for other cpus, which may
+// wait for us at the same time, possibly with interrupt disabled
+static void mmu_flush_poll() {
+    flush_req_t * req = thiscpu_ptr(flush_req);
+    if (atomic32_get(&req->seq) != atomic32_get(&req->done)) {
+        mmu_flush_proc();
+    }
+}
 
-    // pml4 table is always present
-    u64 * pml4 = (u64 *) phys_to_virt(ctx);
+// add the batch to request of `cpu`, return sequence number to wait for
+static u32 flush_post(int cpu, usize ctx, mmu_batch_t * batch, usize drop) {
+    flush_req_t * req = percpu_ptr(cpu, flush_req);
+    while (1) {
+        u32 key = int_lock();
+        raw_spin_take(&req->lock);
+
+        // only one context could be dropped at a time
+        if ((0 != drop) && (0 != req->drop) && (drop != req->drop)) {
+            raw_spin_give(&req->lock);
+            int_unlock(key);
+            mmu_flush_poll();
+            cpu_relax();
+            continue;
+        }
+
+        if (req->count + batch->count > FLUSH_BATCH) {
+            req->count = FLUSH_BATCH + 1;
+        } else {
+            for (u32 i = 0; i < batch->count; ++i) {
+                req->ctxs [req->count] = ctx;
+                req->addrs[req->count] = batch->addrs[i];
+                ++req->count;
+            }
+        }
+        if (0 != drop) {
+            req->drop = drop;
+        }
+        u32 seq = ++req->seq;
+        raw_spin_give(&req->lock);
+        int_unlock(key);
+        return seq;
+    }
+}
 
-    // check if PDP is present
-    if (0 == (pml4[pml4e] & MMU_ADDR)) {
-        pfn_t pfn   = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        pml4[pml4e] = ((u64) pfn << PAGE_SHIFT) & MMU_ADDR;
-        memset(phys_to_virt((u64) pfn << PAGE_SHIFT), 0, PAGE_SIZE);
+// free page tables collected in the batch
+static void batch_free_tables(mmu_batch_t * batch) {
+    while (NO_PAGE != batch->tables) {
+        pfn_t pfn = batch->tables;
+        batch->tables = page_array[pfn].next;
+        page_block_free(pfn, 0);
     }
-    pml4[pml4e] |= MMU_US| MMU_RW | MMU_P;
-    u64 * pdp = (u64 *) phys_to_virt(pml4[pml4e] & MMU_ADDR);
+}
 
-    // check if PD is present
-    if (0 == (pdp[pdpe] & MMU_ADDR)) {
-        pfn_t pfn = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        pdp[pdpe] = ((u64) pfn << PAGE_SHIFT) & MMU_ADDR;
-        memset(phys_to_virt((u64) pfn << PAGE_SHIFT), 0, PAGE_SIZE);
+// invalidate TLB entries in the batch on all cpus using this context
+// kernel space is shared by all contexts, so it's flushed everywhere
+// if `drop` is set, cpus still having `ctx` loaded switch to kernel_ctx
+static void tlb_shootdown(usize ctx, mmu_batch_t * batch, int drop) {
+    if ((0 == batch->count) && !drop) {
+        batch_free_tables(batch);
+        return;
     }
-    pdp[pdpe] |= MMU_US| MMU_RW | MMU_P;
-    u64 * pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
 
-    // fill the final entry
-    pd[pde] = (pa & MMU_ADDR) | fields | MMU_PS | MMU_P;
+    int all  = (ctx == kernel_ctx);
+    int self = cpu_index();
+    u32 key  = int_lock();
+    if (drop) {
+        pcid_drop(ctx);
+    }
+    tlb_flush(ctx, batch->count, batch->addrs);
+    int_unlock(key);
+
+    // page table entries must be visible before checking other cpus
+    cpu_fence();
+
+    u32 seqs[MAX_CPU_COUNT];
+    u64 mask = 0;
+    for (int i = 0; i < cpu_activated; ++i) {
+        if ((i == self) ||
+            (!all && (percpu_var(i, mmu_loaded) != ctx) && !pcid_cached(i, ctx))) {
+            continue;
+        }
+        seqs[i] = flush_post(i, ctx, batch, drop ? ctx : 0);
+        mask   |= 1UL << i;
+        loapic_emit_ipi(i, VECNUM_FLUSHMMU);
+    }
+
+    // wait for acknowledgement, serve requests to us to avoid deadlock
+    for (int i = 0; i < cpu_activated; ++i) {
+        if (0 == (mask & (1UL << i))) {
+            continue;
+        }
+        u32 * done = &percpu_var(i, flush_req).done;
+        while ((s32) (atomic32_get(done) - seqs[i]) < 0) {
+            mmu_flush_poll();
+            cpu_relax();
+        }
+    }
+
+    batch_free_tables(batch);
+    batch->count = 0;
+}
+
+//------------------------------------------------------------------------------
+// page table allocation
+
+// count page tables to be created when mapping [va, va + n pages) to pa
+// work in 2M granularity, so we don't walk from root for each page
+static usize mmu_count_tables(usize ctx, u64 va, u64 pa, usize n) {
+    u64 * pml4  = (u64 *) phys_to_virt(ctx);
+    u64   end   = va + n * PAGE_SIZE;
+    usize count = 0;
+
+    for (u64 v = va & ~(0x200000UL - 1); v < end; v += 0x200000) {
+        u64 pde   = (v >> 21) & 0x01ff;
+        u64 pdpe  = (v >> 30) & 0x01ff;
+        u64 pml4e = (v >> 39) & 0x01ff;
+        int first = (v <= va);
+
+        // will this 1G region be mapped by a single PDPE?
+        if (support_1gpage && IS_ALIGNED(v, 0x40000000) &&
+            (v >= va) && (v + 0x40000000 <= end) &&
+            IS_ALIGNED(v - va + pa, 0x40000000)) {
+            if ((0 == (pml4[pml4e] & MMU_ADDR)) &&
+                (first || IS_ALIGNED(v, (1UL << PML4E_SHIFT)))) {
+                count += 1; // new PDP
+            }
+            v += 0x40000000 - 0x200000;
+            continue;
+        }
+
+        // will this 2M region be mapped by a single PDE?
+        int huge  = (v >= va) && (v + 0x200000 <= end) &&
+                    IS_ALIGNED(v - va + pa, 0x200000);
+
+        u64 * pdp = NULL;
+        u64 * pd  = NULL;
+        if (0 != (pml4[pml4e] & MMU_ADDR)) {
+            pdp = (u64 *) phys_to_virt(pml4[pml4e] & MMU_ADDR);
+        } else if (first || IS_ALIGNED(v, (1UL << PML4E_SHIFT))) {
+            count += 1;     // new PDP, created once for each 512G
+        }
+        if ((NULL != pdp) && (0 != (pdp[pdpe] & MMU_ADDR))) {
+            pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
+        } else if (first || IS_ALIGNED(v, (1UL << PDPE_SHIFT))) {
+            count += 1;     // new PD, created once for each 1G
+        }
+        if (((NULL == pd) || (0 == (pd[pde] & MMU_P)) ||
+             (0 != (pd[pde] & MMU_PS))) && !huge) {
+            count += 1;     // new PT, or 2M page split into PT
+        }
+    }
+
+    return count;
+}
+
+// check whether `va` is mapped by a 2M page
+static int mmu_is_huge(usize ctx, u64 va) {
+    u64 * pml4  = (u64 *) phys_to_virt(ctx);
+    u64 * pml4e = &pml4[(va >> PML4E_SHIFT) & 0x01ff];
+    if (0 == (* pml4e & MMU_P)) {
+        return NO;
+    }
+    u64 * pdp  = (u64 *) phys_to_virt(* pml4e & MMU_ADDR);
+    u64 * pdpe = &pdp[(va >> PDPE_SHIFT) & 0x01ff];
+    if ((0 == (* pdpe & MMU_P)) || (0 != (* pdpe & MMU_PS))) {
+        return NO;
+    }
+    u64 * pd  = (u64 *) phys_to_virt(* pdpe & MMU_ADDR);
+    u64   pde = pd[(va >> PDE_SHIFT) & 0x01ff];
+    return ((MMU_P | MMU_PS) == (pde & (MMU_P | MMU_PS))) ? YES : NO;
+}
+
+// count 2M pages only partially covered by [va, va + n pages), they are
+// split when unmapped or protected. only the first and the last 2M could
+// be partially covered
+static usize mmu_count_splits(usize ctx, u64 va, usize n) {
+    u64   end   = va + n * PAGE_SIZE;
+    u64   first = ROUND_DOWN(va,      0x200000);
+    u64   last  = ROUND_DOWN(end - 1, 0x200000);
+    usize count = 0;
+
+    if ((first < va) || (first + 0x200000 > end)) {
+        count += mmu_is_huge(ctx, first);
+    }
+    if ((last != first) && (last + 0x200000 > end)) {
+        count += mmu_is_huge(ctx, last);
+    }
+    return count;
+}
+
+// take one page from the preallocated list, which is already cleared
+// if the list is empty, allocate a new zeroed page, NO_PAGE if failed
+static pfn_t mmu_table_alloc(pglist_t * tables) {
+    pfn_t pfn = pglist_pop_head(tables);
+
+    if (NO_PAGE == pfn) {
+        pfn = page_block_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, 0);
+        if (NO_PAGE == pfn) {
+            return NO_PAGE;
+        }
+    } else {
+        // split the block, put the second halves back to the list
+        for (int o = page_array[pfn].order; o > 0; --o) {
+            pfn_t bud = pfn + (1U << (o - 1));
+            page_array[bud].block = 1;
+            page_array[bud].order = o - 1;
+            pglist_push_head(tables, bud);
+        }
+        page_array[pfn].order = 0;
+    }
+
+    page_array[pfn].type    = PT_PGTABLE;
+    page_array[pfn].entries = 0;
+    return pfn;
+}
+
+static inline u32 * mmu_table_entries(u64 entry) {
+    return &page_array[(entry & MMU_ADDR) >> PAGE_SHIFT].entries;
+}
+
+// page table is freed after TLB shootdown, since other cpus may still
+// walk through it
+static void mmu_table_free(u64 entry, mmu_batch_t * batch) {
+    pfn_t pfn = (pfn_t) ((entry & MMU_ADDR) >> PAGE_SHIFT);
+    page_array[pfn].type = PT_KERNEL;
+    page_array[pfn].next = batch->tables;
+    batch->tables = pfn;
+}
+
+// get the table pointed by `entry`, create a new one if not present
+// `count` is the entry counter of table holding `entry`, NULL for PML4
+// return NULL if no page for the new table
+static u64 * mmu_table_get(u64 * entry, u32 * count, pglist_t * tables) {
+    if (0 == (* entry & MMU_P)) {
+        pfn_t pfn = mmu_table_alloc(tables);
+        if (NO_PAGE == pfn) {
+            return NULL;
+        }
+        * entry   = ((u64) pfn << PAGE_SHIFT) | MMU_US | MMU_RW | MMU_P;
+        if (NULL != count) {
+            ++(* count);
+        }
+    }
+    return (u64 *) phys_to_virt(* entry & MMU_ADDR);
+}
+
+// replace 2M entry with a page table holding the same mapping in 4K
+// translation is not changed, so no TLB flush is needed
+static int mmu_table_split(u64 * pde, pglist_t * tables) {
+    u64 base   = * pde & MMU_ADDR & ~MMU_PAT_2M;
+    u64 fields = * pde & ~(MMU_ADDR | MMU_PS);
+    if (0 != (* pde & MMU_PAT_2M)) {
+        fields |= MMU_PAT_4K;
+    }
+
+    pfn_t pfn = mmu_table_alloc(tables);
+    if (NO_PAGE == pfn) {
+        return ERROR;
+    }
+    u64 * pt  = (u64 *) phys_to_virt((u64) pfn << PAGE_SHIFT);
+    for (int i = 0; i < 512; ++i) {
+        pt[i] = (base + ((u64) i << PAGE_SHIFT)) | fields;
+    }
+    page_array[pfn].entries = 512;
+    * pde = ((u64) pfn << PAGE_SHIFT) | MMU_US | MMU_RW | MMU_P;
+    return OK;
+}
+
+//------------------------------------------------------------------------------
+// range walker, each table is visited once, entries filled in a tight loop
+// `n` pages starting from `va` never cross the end of the table
+// tables needed are preallocated, walkers only fail if that's not enough,
+// leaving entries before the failure already changed
+
+// fill 4K entries in a page table
+static void mmu_map_pt(u64 * pt, u32 * count, u64 va, u64 pa, usize n,
+                       u64 fields, mmu_batch_t * batch) {
+    u64 * pte = &pt[(va >> PTE_SHIFT) & 0x01ff];
+    for (usize i = 0; i < n; ++i) {
+        // old mapping might be cached in TLB
+        if (0 == (pte[i] & MMU_P)) {
+            ++(* count);
+        } else {
+            batch_add(batch, va + (i << PAGE_SHIFT));
+        }
+        pte[i] = ((pa + (i << PAGE_SHIFT)) & MMU_ADDR) | fields | MMU_P;
+    }
+}
+
+// fill 2M entries in a page directory, or go down to page tables
+static int mmu_map_pd(u64 * pd, u32 * count, u64 va, u64 pa, usize n,
+                      u64 fields, pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pde  = &pd[(va >> PDE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 512 - ((va >> PTE_SHIFT) & 0x01ff));
+
+        if ((512 == step) && IS_ALIGNED(pa, 0x200000)) {
+            // use 2M pages whenever possible
+            // page table replaced is no longer needed, flush all its entries
+            if (0 == (* pde & MMU_P)) {
+                ++(* count);
+            } else if (0 == (* pde & MMU_PS)) {
+                mmu_table_free(* pde, batch);
+                batch->count = FLUSH_BATCH + 1;
+            } else {
+                batch_add(batch, va);
+            }
+            * pde = (pa & MMU_ADDR) | fields | MMU_PS | MMU_P;
+        } else {
+            if ((0 != (* pde & MMU_P)) && (0 != (* pde & MMU_PS)) &&
+                (OK != mmu_table_split(pde, tables))) {
+                return ERROR;
+            }
+            u64 * pt = mmu_table_get(pde, count, tables);
+            if (NULL == pt) {
+                return ERROR;
+            }
+            mmu_map_pt(pt, mmu_table_entries(* pde), va, pa, step, fields, batch);
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        pa += (u64) step << PAGE_SHIFT;
+        n  -= step;
+    }
+    return OK;
+}
+
+// fill 1G entries in a page-directory-pointer table, or go down to PD
+static int mmu_map_pdp(u64 * pdp, u32 * count, u64 va, u64 pa, usize n,
+                       u64 fields, pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pdpe = &pdp[(va >> PDPE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 0x40000 - ((va >> PTE_SHIFT) & 0x3ffff));
+
+        if (support_1gpage && (0x40000 == step) && IS_ALIGNED(pa, 0x40000000)) {
+            // direct map uses 1G pages if possible
+            // page directory replaced is no longer needed
+            if (0 == (* pdpe & MMU_P)) {
+                ++(* count);
+            } else {
+                if (0 == (* pdpe & MMU_PS)) {
+                    u64 * pd = (u64 *) phys_to_virt(* pdpe & MMU_ADDR);
+                    for (int i = 0; i < 512; ++i) {
+                        if ((0 != (pd[i] & MMU_P)) && (0 == (pd[i] & MMU_PS))) {
+                            mmu_table_free(pd[i], batch);
+                        }
+                    }
+                    mmu_table_free(* pdpe, batch);
+                }
+                batch->count = FLUSH_BATCH + 1;
+            }
+            * pdpe = (pa & MMU_ADDR) | fields | MMU_PS | MMU_P;
+        } else {
+            // 1G pages are only used by direct map, never remapped
+            dbg_assert(0 == (* pdpe & MMU_PS));
+            u64 * pd = mmu_table_get(pdpe, count, tables);
+            if ((NULL == pd) ||
+                (OK != mmu_map_pd(pd, mmu_table_entries(* pdpe), va, pa, step,
+                                  fields, tables, batch))) {
+                return ERROR;
+            }
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        pa += (u64) step << PAGE_SHIFT;
+        n  -= step;
+    }
+    return OK;
+}
+
+// clear 4K entries in a page table
+static void mmu_unmap_pt(u64 * pt, u32 * count, u64 va, usize n,
+                         mmu_batch_t * batch) {
+    u64 * pte = &pt[(va >> PTE_SHIFT) & 0x01ff];
+    for (usize i = 0; i < n; ++i) {
+        if (0 != (pte[i] & MMU_P)) {
+            pte[i] = 0;
+            --(* count);
+            batch_add(batch, va + (i << PAGE_SHIFT));
+        }
+    }
+}
+
+// clear entries in a page directory, free page tables becoming empty
+// if unmap range is less than 2M, the 2M page is split first
+static int mmu_unmap_pd(u64 * pd, u32 * count, u64 va, usize n, int reclaim,
+                        pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pde  = &pd[(va >> PDE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 512 - ((va >> PTE_SHIFT) & 0x01ff));
+
+        if (0 == (* pde & MMU_P)) {
+            // nothing mapped
+        } else if ((0 != (* pde & MMU_PS)) && (512 == step)) {
+            * pde = 0;
+            --(* count);
+            batch_add(batch, va);
+        } else {
+            if ((0 != (* pde & MMU_PS)) && (OK != mmu_table_split(pde, tables))) {
+                return ERROR;
+            }
+            u64 * pt = (u64 *) phys_to_virt(* pde & MMU_ADDR);
+            mmu_unmap_pt(pt, mmu_table_entries(* pde), va, step, batch);
+            if (reclaim && (0 == * mmu_table_entries(* pde))) {
+                mmu_table_free(* pde, batch);
+                * pde = 0;
+                --(* count);
+            }
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        n  -= step;
+    }
+    return OK;
+}
+
+// clear entries in a page-directory-pointer table, free empty PD
+static int mmu_unmap_pdp(u64 * pdp, u32 * count, u64 va, usize n, int reclaim,
+                         pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pdpe = &pdp[(va >> PDPE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 0x40000 - ((va >> PTE_SHIFT) & 0x3ffff));
+
+        if (0 != (* pdpe & MMU_P)) {
+            // 1G pages are only used by direct map, never unmapped
+            dbg_assert(0 == (* pdpe & MMU_PS));
+            u64 * pd = (u64 *) phys_to_virt(* pdpe & MMU_ADDR);
+            if (OK != mmu_unmap_pd(pd, mmu_table_entries(* pdpe), va, step,
+                                   reclaim, tables, batch)) {
+                return ERROR;
+            }
+            if (reclaim && (0 == * mmu_table_entries(* pdpe))) {
+                mmu_table_free(* pdpe, batch);
+                * pdpe = 0;
+                --(* count);
+            }
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        n  -= step;
+    }
+    return OK;
+}
+
+// change protection bits of present 4K entries in a page table
+static void mmu_protect_pt(u64 * pt, u64 va, usize n, u64 fields,
+                           mmu_batch_t * batch) {
+    u64 * pte = &pt[(va >> PTE_SHIFT) & 0x01ff];
+    for (usize i = 0; i < n; ++i) {
+        if ((0 != (pte[i] & MMU_P)) && (fields != (pte[i] & MMU_PROT))) {
+            pte[i] = (pte[i] & ~MMU_PROT) | fields;
+            batch_add(batch, va + (i << PAGE_SHIFT));
+        }
+    }
+}
+
+// change protection bits in a page directory
+// if range is less than 2M, the 2M page is split first
+static int mmu_protect_pd(u64 * pd, u64 va, usize n, u64 fields,
+                          pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pde  = &pd[(va >> PDE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 512 - ((va >> PTE_SHIFT) & 0x01ff));
 
-    // clear TLB entry
-    if (read_cr3() == ctx) {
-        ASM("invlpg (%0)" :: "r"(va));
+        if (0 == (* pde & MMU_P)) {
+            // nothing mapped
+        } else if ((0 != (* pde & MMU_PS)) && (512 == step)) {
+            if (fields != (* pde & MMU_PROT)) {
+                * pde = (* pde & ~MMU_PROT) | fields;
+                batch_add(batch, va);
+            }
+        } else {
+            if ((0 != (* pde & MMU_PS)) && (OK != mmu_table_split(pde, tables))) {
+                return ERROR;
+            }
+            u64 * pt = (u64 *) phys_to_virt(* pde & MMU_ADDR);
+            mmu_protect_pt(pt, va, step, fields, batch);
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        n  -= step;
     }
+    return OK;
+}
+
+// change protection bits in a page-directory-pointer table
+static int mmu_protect_pdp(u64 * pdp, u64 va, usize n, u64 fields,
+                           pglist_t * tables, mmu_batch_t * batch) {
+    while (n) {
+        u64 * pdpe = &pdp[(va >> PDPE_SHIFT) & 0x01ff];
+        usize step = MIN(n, 0x40000 - ((va >> PTE_SHIFT) & 0x3ffff));
+
+        if (0 != (* pdpe & MMU_P)) {
+            // 1G pages are only used by direct map, never changed
+            dbg_assert(0 == (* pdpe & MMU_PS));
+            u64 * pd = (u64 *) phys_to_virt(* pdpe & MMU_ADDR);
+            if (OK != mmu_protect_pd(pd, va, step, fields, tables, batch)) {
+                return ERROR;
+            }
+        }
+
+        va += (u64) step << PAGE_SHIFT;
+        n  -= step;
+    }
+    return OK;
+}
+
+// convert mapping attributes to protection bits of page entry
+static u64 mmu_fields(u32 attr) {
+    u64 fields = 0;
+    if ((attr & MMU_KERNEL) == 0) { fields |= MMU_US; }
+    if ((attr & MMU_RDONLY) == 0) { fields |= MMU_RW; }
+    if ((attr & MMU_NOEXEC) != 0) { fields |= MMU_NX; }
+    return fields;
 }
 
 //------------------------------------------------------------------------------
 // public functions
 
 usize mmu_ctx_get() {
-    return (usize) read_cr3();
+    return thiscpu_var(mmu_loaded);
 }
 
+// load context into cr3, called by `return_to_task` on task switch
+// reuse its pcid if still tagged, otherwise recycle one and flush it
 void mmu_ctx_set(usize ctx) {
-    write_cr3((u64) ctx);
+    u32 key = int_lock();
+
+    // must be visible before checking pcid, see `mmu_flush`
+    thiscpu_var(mmu_loaded) = ctx;
+    cpu_fence();
+
+    if (!support_pcid) {
+        write_cr3((u64) ctx);
+        int_unlock(key);
+        return;
+    }
+
+    u32 pcid = pcid_of(ctx);
+    if (0 != pcid) {
+        write_cr3((u64) ctx | (u64) pcid | CR3_NOFLUSH);
+        int_unlock(key);
+        return;
+    }
+
+    pcid = thiscpu_var(pcid_next) % (PCID_COUNT - 1) + 1;
+    thiscpu_var(pcid_next) = pcid;
+    thiscpu_var(pcid_ctx)[pcid] = ctx;
+    write_cr3((u64) ctx | (u64) pcid);
+    int_unlock(key);
 }
 
 // create a new context table, allocate space for top-level table
 usize mmu_ctx_create() {
-    pfn_t pml4t = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
+    pfn_t pml4t = page_block_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, 0);
     usize ctx   = (usize) pml4t << PAGE_SHIFT;
-    memset(phys_to_virt(ctx), 0, PAGE_SIZE / 2);        // user space
     memcpy(phys_to_virt(ctx)        + PAGE_SIZE / 2,    // kernel space
            phys_to_virt(kernel_ctx) + PAGE_SIZE / 2,
            PAGE_SIZE / 2);
     return ctx;
 }
 
+// free all page tables of user space and the context table itself
+// pages mapped in this context are not touched, owners shall free them
+void mmu_ctx_destroy(usize ctx) {
+    dbg_assert(ctx != kernel_ctx);
+
+    // don't free the page table in use, by this or other cpus
+    mmu_batch_t batch = MMU_BATCH_INIT;
+    if (thiscpu_var(mmu_loaded) == ctx) {
+        mmu_ctx_set(kernel_ctx);
+    }
+    tlb_shootdown(ctx, &batch, YES);
+
+    u64 * pml4 = (u64 *) phys_to_virt(ctx);
+    for (int i = 0; i < 256; ++i) {
+        if (0 == (pml4[i] & MMU_P)) {
+            continue;
+        }
+        u64 * pdp = (u64 *) phys_to_virt(pml4[i] & MMU_ADDR);
+        for (int j = 0; j < 512; ++j) {
+            if (0 == (pdp[j] & MMU_P)) {
+                continue;
+            }
+            u64 * pd = (u64 *) phys_to_virt(pdp[j] & MMU_ADDR);
+            for (int k = 0; k < 512; ++k) {
+                if ((0 != (pd[k] & MMU_P)) && (0 == (pd[k] & MMU_PS))) {
+                    mmu_table_free(pd[k], &batch);
+                }
+            }
+            mmu_table_free(pdp[j], &batch);
+        }
+        mmu_table_free(pml4[i], &batch);
+    }
+
+    batch_free_tables(&batch);
+    page_block_free((pfn_t) (ctx >> PAGE_SHIFT), 0);
+}
+
 // perform address translation by checking page table
 // return NO_ADDR if mapping for `va` is not present
 usize mmu_translate(usize ctx, usize va) {
@@ -162,6 +831,12 @@ usize mmu_translate(usize ctx, usize va) {
         return NO_ADDR;
     }
 
+    if (0 != (pdp[pdpe] & MMU_PS)) {
+        u64 base = pdp[pdpe] & MMU_ADDR & ~MMU_PAT_2M;
+        dbg_assert(0 == (base & (0x40000000 - 1)));
+        return base + (va & (0x40000000 - 1));
+    }
+
     u64 * pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
     if (0 == (pd[pde] & MMU_P)) {
         return NO_ADDR;
@@ -180,121 +855,295 @@ usize mmu_translate(usize ctx, usize va) {
     return (pt[pte] & MMU_ADDR) + (va & (0x1000 - 1));
 }
 
+// check whether nothing is mapped in [va, va + n pages)
+// missing upper entries are skipped as a whole, without going down
+int mmu_is_empty(usize ctx, usize va, usize n) {
+    u64 * pml4 = (u64 *) phys_to_virt(ctx);
+    u64   v    = (u64) va;
+
+    while (n) {
+        u64   pte   = (v >> 12) & 0x01ff;
+        u64   pde   = (v >> 21) & 0x01ff;
+        u64   pdpe  = (v >> 30) & 0x01ff;
+        u64   pml4e = (v >> 39) & 0x01ff;
+        usize step;
+
+        if (0 == (pml4[pml4e] & MMU_P)) {
+            step = 0x8000000 - ((v >> PTE_SHIFT) & 0x7ffffff);
+        } else {
+            u64 * pdp = (u64 *) phys_to_virt(pml4[pml4e] & MMU_ADDR);
+            if (0 == (pdp[pdpe] & MMU_P)) {
+                step = 0x40000 - ((v >> PTE_SHIFT) & 0x3ffff);
+            } else if (0 != (pdp[pdpe] & MMU_PS)) {
+                return NO;
+            } else {
+                u64 * pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
+                if (0 == (pd[pde] & MMU_P)) {
+                    step = 512 - pte;
+                } else if (0 != (pd[pde] & MMU_PS)) {
+                    return NO;
+                } else {
+                    u64 * pt = (u64 *) phys_to_virt(pd[pde] & MMU_ADDR);
+                    if (0 != (pt[pte] & MMU_P)) {
+                        return NO;
+                    }
+                    step = 1;
+                }
+            }
+        }
+
+        step = MIN(step, n);
+        v   += (u64) step << PAGE_SHIFT;
+        n   -= step;
+    }
+    return YES;
+}
+
+// invalidate TLB entries collected in the batch on all cpus using this
+// context, then free page tables removed. must be called without spinlock
+void mmu_flush(usize ctx, mmu_batch_t * batch) {
+    tlb_shootdown(ctx, batch, NO);
+}
+
 // create mapping from va to pa, overwriting existing mapping
-void mmu_map(usize ctx, usize va, usize pa, usize n, u32 attr) {
+// return ERROR if no memory for page tables, nothing is changed then
+// stale entries are added to `batch`, or flushed at once if it is NULL
+int mmu_map(usize ctx, usize va, usize pa, usize n, u32 attr, mmu_batch_t * batch) {
     u64 v = (u64) va;
     u64 p = (u64) pa;
 
     dbg_assert(IS_ALIGNED(v, PAGE_SIZE));
     dbg_assert(IS_ALIGNED(p, PAGE_SIZE));
 
-    u64 fields = 0;
-    if ((attr & MMU_KERNEL) == 0) { fields |= MMU_US; }
-    if ((attr & MMU_RDONLY) == 0) { fields |= MMU_RW; }
-    if ((attr & MMU_NOEXEC) != 0) { fields |= MMU_NX; }
+    u64 fields = mmu_fields(attr);
 
-    while (n) {
-        if ((n >= 512)              &&
-            IS_ALIGNED(v, 0x200000) &&
-            IS_ALIGNED(p, 0x200000)) {
-            // use 2M pages whenever possible
-            mmu_map_2m(ctx, v, p, fields);
-            v += 0x200000;
-            p += 0x200000;
-            n -= 512;
-        } else {
-            mmu_map_4k(ctx, v, p, fields);
-            v += PAGE_SIZE;
-            p += PAGE_SIZE;
-            n -= 1;
+    // kernel space is the same in all contexts, keep it across cr3 reload
+    if (v >= MAPPED_ADDR) {
+        fields |= MMU_G;
+    }
+
+    // allocate all missing page tables at once
+    mmu_batch_t local  = MMU_BATCH_INIT;
+    pglist_t    tables = PGLIST_INIT;
+    usize       count  = mmu_count_tables(ctx, v, p, n);
+    if (NULL == batch) {
+        batch = &local;
+    }
+    if ((count > 0) &&
+        (OK != page_list_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, count, &tables))) {
+        return ERROR;
+    }
+
+    // walk each 512G region covered, PDP is created once
+    u64 * pml4 = (u64 *) phys_to_virt(ctx);
+    int   ret  = OK;
+    while (n && (OK == ret)) {
+        u64 * pml4e = &pml4[(v >> PML4E_SHIFT) & 0x01ff];
+        usize step  = MIN(n, 0x8000000 - ((v >> PTE_SHIFT) & 0x7ffffff));
+        u64 * pdp   = mmu_table_get(pml4e, NULL, &tables);
+        if ((NULL == pdp) ||
+            (OK != mmu_map_pdp(pdp, mmu_table_entries(* pml4e), v, p, step,
+                               fields, &tables, batch))) {
+            ret = ERROR;
         }
+        v += (u64) step << PAGE_SHIFT;
+        p += (u64) step << PAGE_SHIFT;
+        n -= step;
     }
+
+    // return unused tables, if any
+    page_list_free(&tables);
+    if (&local == batch) {
+        mmu_flush(ctx, &local);
+    }
+    return ret;
 }
 
-void mmu_unmap(usize ctx, usize va, usize n) {
-    u64 * pml4 = (u64 *) phys_to_virt(ctx);
-    usize end  = va + n * PAGE_SIZE;
+// remove mapping of [va, va + n pages), free page tables becoming empty
+// tables of kernel space are shared by all contexts, never freed
+// return ERROR if no memory for splitting 2M pages, nothing is changed then
+// pages unmapped are still reachable through TLB until `batch` is flushed
+int mmu_unmap(usize ctx, usize va, usize n, mmu_batch_t * batch) {
+    u64 *       pml4   = (u64 *) phys_to_virt(ctx);
+    u64         v      = (u64) va;
+    mmu_batch_t local  = MMU_BATCH_INIT;
+    pglist_t    tables = PGLIST_INIT;     // for splitting 2M pages
 
-    for (; va < end; va += PAGE_SIZE) {
-        u64 pte   = (va >> 12) & 0x01ff;
-        u64 pde   = (va >> 21) & 0x01ff;
-        u64 pdpe  = (va >> 30) & 0x01ff;
-        u64 pml4e = (va >> 39) & 0x01ff;
+    dbg_assert(IS_ALIGNED(v, PAGE_SIZE));
+    if (NULL == batch) {
+        batch = &local;
+    }
 
-        if (0 == (pml4[pml4e] & MMU_P)) {
-            continue;
-        }
+    usize count = mmu_count_splits(ctx, v, n);
+    if ((count > 0) &&
+        (OK != page_list_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, count, &tables))) {
+        return ERROR;
+    }
 
-        u64 * pdp = (u64 *) phys_to_virt(pml4[pml4e] & MMU_ADDR);
-        if (0 == (pdp[pdpe] & MMU_P)) {
-            continue;
-        }
+    int ret = OK;
+    while (n && (OK == ret)) {
+        u64   i     = (v >> PML4E_SHIFT) & 0x01ff;
+        usize step  = MIN(n, 0x8000000 - ((v >> PTE_SHIFT) & 0x7ffffff));
+        int   user  = (i < 256);
 
-        u64 * pd = (u64 *) phys_to_virt(pdp[pdpe] & MMU_ADDR);
-        if (0 == (pd[pde] & MMU_P)) {
-            continue;
+        if (0 != (pml4[i] & MMU_P)) {
+            u64 * pdp = (u64 *) phys_to_virt(pml4[i] & MMU_ADDR);
+            ret = mmu_unmap_pdp(pdp, mmu_table_entries(pml4[i]), v, step,
+                                user, &tables, batch);
+            if (user && (0 == * mmu_table_entries(pml4[i]))) {
+                mmu_table_free(pml4[i], batch);
+                pml4[i] = 0;
+            }
         }
 
-        if (0 != (pd[pde] & MMU_PS)) {
-            // 2M page size, first retrieve current mapping
-            u64 va_2m  = va & ~(0x200000 - 1);
-            u64 pa_2m  = pd[pde] & MMU_ADDR;
-            u64 fields = pd[pde] & (MMU_US | MMU_RW | MMU_NX);
-            dbg_assert(0 == (pa_2m & (0x200000 - 1)));
+        v += (u64) step << PAGE_SHIFT;
+        n -= step;
+    }
 
-            // remove current mapping
-            pd[pde] &= ~MMU_P;
+    page_list_free(&tables);
+    if (&local == batch) {
+        mmu_flush(ctx, &local);
+    }
+    return ret;
+}
 
-            // if unmap range is less than 2M, add back rest range
-            if (pte > 0) {
-                mmu_map(ctx, va_2m, pa_2m, pte, fields);
-            }
-            if (end < va + PAGE_SIZE * 512) {
-                pa_2m += end - va_2m;
-                usize n = (va + PAGE_SIZE * 512 - end) >> PAGE_SHIFT;
-                mmu_map(ctx, end, pa_2m, n, fields);
-            }
+// change attributes of present mappings in [va, va + n pages)
+// pages not mapped are skipped, TLB is flushed once at the end
+// return ERROR if no memory for splitting 2M pages, nothing is changed then
+int mmu_protect(usize ctx, usize va, usize n, u32 attr, mmu_batch_t * batch) {
+    u64 *       pml4   = (u64 *) phys_to_virt(ctx);
+    u64         v      = (u64) va;
+    u64         fields = mmu_fields(attr);
+    mmu_batch_t local  = MMU_BATCH_INIT;
+    pglist_t    tables = PGLIST_INIT;     // for splitting 2M pages
+
+    dbg_assert(IS_ALIGNED(v, PAGE_SIZE));
+    if (NULL == batch) {
+        batch = &local;
+    }
+
+    usize count = mmu_count_splits(ctx, v, n);
+    if ((count > 0) &&
+        (OK != page_list_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, count, &tables))) {
+        return ERROR;
+    }
+
+    int ret = OK;
+    while (n && (OK == ret)) {
+        u64   i    = (v >> PML4E_SHIFT) & 0x01ff;
+        usize step = MIN(n, 0x8000000 - ((v >> PTE_SHIFT) & 0x7ffffff));
+
+        if (0 != (pml4[i] & MMU_P)) {
+            u64 * pdp = (u64 *) phys_to_virt(pml4[i] & MMU_ADDR);
+            ret = mmu_protect_pdp(pdp, v, step, fields, &tables, batch);
         }
+
+        v += (u64) step << PAGE_SHIFT;
+        n -= step;
     }
+
+    page_list_free(&tables);
+    if (&local == batch) {
+        mmu_flush(ctx, &local);
+    }
+    return ret;
 }
 
 //------------------------------------------------------------------------------
 // create page table for kernel range
 
-__INIT void kernel_ctx_init() {
+// device registers accessed through direct map, registered before
+// kernel_ctx_init, since direct map only covers the memory map
+#define IO_RANGE_MAX 16
+static __INITDATA usize io_ranges[IO_RANGE_MAX][2];
+static __INITDATA int   io_count = 0;
+
+__INIT void kernel_ctx_add_io(usize pa, usize size) {
+    if (io_count < IO_RANGE_MAX) {
+        io_ranges[io_count][0] = pa;
+        io_ranges[io_count][1] = pa + size;
+        ++io_count;
+    }
+}
+
+// add [start, end) into the sorted list of direct map ranges
+// ranges are extended to 2M boundaries, overlapped ones are merged
+static __INIT int direct_add(usize (* list)[2], int count, usize start, usize end) {
+    start &= ~(0x200000UL - 1);
+    end    = ROUND_UP(end, 0x200000);
+
+    int i = count++;
+    for (; (i > 0) && (list[i - 1][0] > start); --i) {
+        list[i][0] = list[i - 1][0];
+        list[i][1] = list[i - 1][1];
+    }
+    list[i][0] = start;
+    list[i][1] = end;
+
+    int j = 0;
+    for (int k = 1; k < count; ++k) {
+        if (list[k][0] <= list[j][1]) {
+            list[j][1] = MAX(list[j][1], list[k][1]);
+        } else {
+            ++j;
+            list[j][0] = list[k][0];
+            list[j][1] = list[k][1];
+        }
+    }
+    return j + 1;
+}
+
+// kernel sections are 2M aligned in `layout.ld`, so they're mapped using
+// 2M pages, all entries in kernel space are global
+__INIT void kernel_ctx_init(u8 * mmap_buf, u32 mmap_len) {
     usize virt, phys, mark;
 
-    pfn_t pml4t = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
+    pfn_t pml4t = page_block_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, 0);
     kernel_ctx  = (usize) pml4t << PAGE_SHIFT;
-    memset(phys_to_virt(kernel_ctx), 0, PAGE_SIZE);
 
     // boot, trampoline and init sections
     virt = KERNEL_VMA;
     phys = KERNEL_LMA;
-    mark = ROUND_UP(&_init_end, PAGE_SIZE);
-    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_KERNEL);
+    mark = ROUND_UP(&_init_end, 0x200000);
+    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_KERNEL, NULL);
 
     // kernel code section
     virt = mark;
     phys = virt - KERNEL_VMA + KERNEL_LMA;
-    mark = ROUND_UP(&_text_end, PAGE_SIZE);
-    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_RDONLY|MMU_KERNEL);
+    mark = ROUND_UP(&_text_end, 0x200000);
+    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_RDONLY|MMU_KERNEL, NULL);
 
     // kernel read only data section
     virt = mark;
     phys = virt - KERNEL_VMA + KERNEL_LMA;
-    mark = ROUND_UP(&_rodata_end, PAGE_SIZE);
-    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_RDONLY|MMU_NOEXEC|MMU_KERNEL);
+    mark = ROUND_UP(&_rodata_end, 0x200000);
+    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_RDONLY|MMU_NOEXEC|MMU_KERNEL, NULL);
 
-    // kernel data section
+    // kernel data section, including percpu area and page array
     virt = mark;
     phys = virt - KERNEL_VMA + KERNEL_LMA;
-    mark = ROUND_UP(&page_array[page_count], PAGE_SIZE);
-    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_NOEXEC|MMU_KERNEL);
+    mark = ROUND_UP(&page_array[page_count], 0x200000);
+    mmu_map(kernel_ctx, virt, phys, (mark - virt) >> PAGE_SHIFT, MMU_NOEXEC|MMU_KERNEL, NULL);
 
-    // map all physical memory to higher half
-    // TODO: only map present pages, and add IO/Local APIC in driver
-    mmu_map(kernel_ctx, MAPPED_ADDR, 0, 1U << 20, MMU_NOEXEC|MMU_KERNEL);
+    // direct map covers all ranges in memory map and device registers
+    // first 2M holds bios data, vga memory and ap trampoline
+    usize (* list)[2] = __builtin_alloca((mmap_len / sizeof(mb_mmap_item_t) + IO_RANGE_MAX + 1) * sizeof(usize[2]));
+    int   count = direct_add(list, 0, 0, 0x200000);
+    mb_mmap_item_t * map_end = (mb_mmap_item_t *) (mmap_buf + mmap_len);
+    for (mb_mmap_item_t * item = (mb_mmap_item_t *) mmap_buf; item < map_end;) {
+        if ((0 != item->len) && (item->addr < MAPPED_SIZE)) {
+            usize end = MIN(item->addr + item->len, MAPPED_SIZE);
+            count = direct_add(list, count, item->addr, end);
+        }
+        item = (mb_mmap_item_t *) ((u64) item + item->size + sizeof(item->size));
+    }
+    for (int i = 0; i < io_count; ++i) {
+        count = direct_add(list, count, io_ranges[i][0], io_ranges[i][1]);
+    }
+    for (int i = 0; i < count; ++i) {
+        usize n = (list[i][1] - list[i][0]) >> PAGE_SHIFT;
+        mmu_map(kernel_ctx, MAPPED_ADDR + list[i][0], list[i][0], n, MMU_NOEXEC|MMU_KERNEL, NULL);
+    }
 
     // switch to kernel context
     mmu_ctx_set(kernel_ctx);
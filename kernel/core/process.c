@@ -19,11 +19,13 @@ process_t * process_create() {
 void process_delete(process_t * pid) {
     // dbg_print("reclaiming process at %llx.\n", pid);
 
-    u32 key = irq_spin_take(&pid->lock);
+    // address space teardown waits for TLB shootdown, do it before lock
     dbg_assert(NULL == pid->tasks.head);
     dbg_assert(NULL == pid->tasks.tail);
     vmspace_destroy(&pid->vm);
 
+    u32 key = irq_spin_take(&pid->lock);
+
     semaphore_destroy(&pid->fd_sem);
     for (int i = 0; i < 32; ++i) {
         if (NULL == pid->fd_array[i]) {
@@ -2,6 +2,7 @@
 
 typedef struct ready_q {
     spin_t   lock;
+    int      node;                  // numa node of this cpu
     int      load;                  // number of tasks
     u32      priorities;            // bit mask
     dllist_t tasks[PRIORITY_COUNT]; // protected by ready_q.lock
@@ -47,18 +48,25 @@ static int find_lowest_cpu(task_t * tid) {
     }
 
     // if can't preempt, choose the lowest loaded cpu instead
+    // with the same load, prefer cpu on the same numa node
+    int lowest_node = -1;
     if (-1 != tid->last_cpu) {
         lowest_cpu  = tid->last_cpu;
         lowest_load = percpu_ptr(lowest_cpu, ready_q)->load;
+        lowest_node = percpu_ptr(lowest_cpu, ready_q)->node;
     } else {
         lowest_cpu  = -1;
         lowest_load = 0x7fffffff;
     }
+    int home_node = lowest_node;
     for (int i = 0; i < cpu_activated; ++i) {
         ready_q_t * rdy = percpu_ptr(i, ready_q);
-        if (rdy->load < lowest_load) {
+        if ((rdy->load < lowest_load) ||
+            ((rdy->load == lowest_load) && (rdy->node == home_node) &&
+             (lowest_node != home_node))) {
             lowest_cpu  = i;
             lowest_load = rdy->load;
+            lowest_node = rdy->node;
         }
     }
 
@@ -199,9 +207,11 @@ static void idle_proc() {
     // lock current task and never give away
     raw_spin_take(&thiscpu_var(tid_prev)->lock);
 
-    // loop forever
+    // loop forever, prepare zeroed pages when there's nothing to do
     while (1) {
-        cpu_sleep();
+        if (NO == page_zero_fill()) {
+            cpu_sleep();
+        }
     }
 }
 
@@ -215,6 +225,7 @@ __INIT void sched_lib_init() {
 
         ready_q_t * rdy = percpu_ptr(i, ready_q);
         rdy->lock       = SPIN_INIT;
+        rdy->node       = percpu_var(i, cpu_node);
         rdy->load       = 1;        // idle task
         rdy->priorities = 1U << 31; // idle task
 
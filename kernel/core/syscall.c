@@ -1,4 +1,5 @@
 #include <wheel.h>
+#include <mman.h>
 
 void * syscall_tbl[SYSCALL_NUM_COUNT];
 
@@ -8,7 +9,7 @@ static void thread_entry(void * entry) {
     vmrange_t * rng = vmspace_alloc(&tid->process->vm, 16 * PAGE_SIZE);
 
     dbg_assert(NULL == tid->ustack);
-    vmspace_map(&tid->process->vm, rng);
+    vmspace_map(&tid->process->vm, rng, 0);
     tid->ustack = rng;
 
     // jump into user mode, won't return
@@ -27,6 +28,13 @@ static void process_entry(void * entry, void * sp) {
     return_to_user((usize) entry, (usize) sp);
 }
 
+// entry of the forked thread, new vmspace, start in kernel mode
+static void fork_entry(syscall_frame_t * saved) {
+    syscall_frame_t frame = * saved;
+    kfree(saved);
+    return_from_fork(&frame);
+}
+
 //------------------------------------------------------------------------------
 // system call handler functions
 
@@ -45,6 +53,8 @@ int do_exit(int exitcode) {
     if (NULL != pid) {
         dl_remove(&pid->tasks, &tid->dl_proc);
         if (dl_is_empty(&pid->tasks)) {
+            // page table is going away, run as kernel task until exit
+            regs_ctx_set(&tid->regs, 0);
             process_delete(pid);
         }
     }
@@ -71,6 +81,48 @@ int do_spawn_thread(void * entry) {
     return 0;
 }
 
+// duplicate current process with only the calling thread, pages are
+// shared copy-on-write. return 1 in parent, 0 in child, -1 on failure
+int do_fork() {
+    task_t    * cur    = thiscpu_var(tid_prev);
+    process_t * parent = cur->process;
+    dbg_assert(NULL != parent);
+
+    // user registers at syscall entry, child resumes from there
+    syscall_frame_t * frame = (syscall_frame_t *) kmalloc(sizeof(syscall_frame_t));
+    if (NULL == frame) {
+        return -1;
+    }
+    * frame = * regs_syscall_frame(&cur->regs);
+
+    process_t * child = process_create();
+    child->entry = parent->entry;
+    if (OK != vmspace_fork(&child->vm, &parent->vm)) {
+        process_delete(child);
+        kfree(frame);
+        return -1;
+    }
+
+    semaphore_take(&parent->fd_sem, SEM_WAIT_FOREVER);
+    for (int i = 0; i < 32; ++i) {
+        if (NULL != parent->fd_array[i]) {
+            child->fd_array[i] = ios_fork(parent->fd_array[i]);
+        }
+    }
+    semaphore_give(&parent->fd_sem);
+
+    task_t * tid = task_create(cur->name, cur->priority, fork_entry, frame, 0,0,0);
+    dl_push_tail(&child->tasks, &tid->dl_proc);
+    regs_ctx_set(&tid->regs, child->vm.ctx);
+    tid->process = child;
+    if (NULL != cur->ustack) {
+        tid->ustack = vmspace_find(&child->vm, cur->ustack->addr);
+    }
+
+    task_resume(tid);
+    return 1;
+}
+
 extern u8 _ramfs_addr;
 
 int do_spawn_process(const char * filename,
@@ -131,8 +183,9 @@ int do_spawn_process(const char * filename,
     }
 
     // allocate pages for user-mode stack
+    // argv and envp are written through pages list, populate it now
     vmrange_t * stk = vmspace_alloc(&pid->vm, 16 * PAGE_SIZE);
-    vmspace_map(&pid->vm, stk);
+    vmspace_populate(&pid->vm, stk, stk->size);
 
     // put argv and envp at the beginning of user stack
     // TODO: also support architectures where stack grows downwards
@@ -229,6 +282,118 @@ size_t do_write(int fd, const void * buf, size_t len) {
     return ret;
 }
 
+// number of pages populated by page fault in current process
+size_t do_fault_count() {
+    process_t * pid = thiscpu_var(tid_prev)->process;
+    return pid->vm.faults;
+}
+
+// translate PROT_* into range flags
+static u32 prot_to_flags(int prot) {
+    u32 flags = 0;
+    if (0 == (prot & PROT_READ))  { flags |= VM_NOACCESS; }
+    if (0 == (prot & PROT_WRITE)) { flags |= VM_RDONLY;   }
+    if (0 == (prot & PROT_EXEC))  { flags |= VM_NOEXEC;   }
+    return flags;
+}
+
+// map anonymous zero-filled memory, pages are populated on demand
+// `addr` is only a hint, if not available, any free range is used
+void * do_mmap(void * addr, size_t len, int prot, int flags) {
+    process_t * pid  = thiscpu_var(tid_prev)->process;
+    usize       size = ROUND_UP(len, PAGE_SIZE);
+    if (0 == size) {
+        return MAP_FAILED;
+    }
+
+    vmrange_t * rng = NULL;
+    if ((NULL != addr) && (((usize) addr & (PAGE_SIZE - 1)) == 0)) {
+        rng = vmspace_alloc_at(&pid->vm, (usize) addr, size);
+    }
+    if (NULL == rng) {
+        rng = vmspace_alloc(&pid->vm, size);
+    }
+    if (NULL == rng) {
+        return MAP_FAILED;
+    }
+
+    u32 vm_flags = VM_MMAP | prot_to_flags(prot);
+    if (0 != (flags & MAP_HUGE)) {
+        vm_flags |= VM_HUGE;
+    }
+    vmspace_map(&pid->vm, rng, vm_flags);
+    return (void *) rng->addr;
+}
+
+// only ranges created by mmap could be unmapped
+int do_munmap(void * addr, size_t len) {
+    process_t * pid  = thiscpu_var(tid_prev)->process;
+    usize       size = ROUND_UP(len, PAGE_SIZE);
+    if ((((usize) addr & (PAGE_SIZE - 1)) != 0) || (0 == size)) {
+        return -1;
+    }
+    if (OK != vmspace_free_at(&pid->vm, (usize) addr, size)) {
+        return -1;
+    }
+    return 0;
+}
+
+int do_mprotect(void * addr, size_t len, int prot) {
+    process_t * pid  = thiscpu_var(tid_prev)->process;
+    usize       size = ROUND_UP(len, PAGE_SIZE);
+    if ((((usize) addr & (PAGE_SIZE - 1)) != 0) || (0 == size)) {
+        return -1;
+    }
+    if (OK != vmspace_protect(&pid->vm, (usize) addr, size, prot_to_flags(prot))) {
+        return -1;
+    }
+    return 0;
+}
+
+// set program break, NULL only queries the current one
+// return the new break, or the current one on failure
+void * do_brk(void * addr) {
+    process_t * pid = thiscpu_var(tid_prev)->process;
+    return (void *) vmspace_brk(&pid->vm, (usize) addr);
+}
+
+// move program break by `incr` bytes, return the old break
+void * do_sbrk(ptrdiff_t incr) {
+    process_t * pid = thiscpu_var(tid_prev)->process;
+    usize       old = vmspace_sbrk(&pid->vm, (ssize) incr);
+    if (NO_ADDR == old) {
+        return MAP_FAILED;
+    }
+    return (void *) old;
+}
+
+// map the named shared memory object, create it if not exist
+// unmapped by munmap, object is freed when no process maps it
+void * do_shm_map(const char * name, size_t len) {
+    process_t * pid = thiscpu_var(tid_prev)->process;
+    if (NULL == name) {
+        return MAP_FAILED;
+    }
+
+    shm_t * shm = shm_get(name, len);
+    if (NULL == shm) {
+        return MAP_FAILED;
+    }
+
+    vmrange_t * rng = vmspace_alloc(&pid->vm, shm->size);
+    if (NULL == rng) {
+        shm_put(shm);
+        return MAP_FAILED;
+    }
+
+    if (OK != vmspace_map_shm(&pid->vm, rng, shm)) {
+        vmspace_free(&pid->vm, rng);
+        shm_put(shm);
+        return MAP_FAILED;
+    }
+    return (void *) rng->addr;
+}
+
 int do_magic() {
     task_dump();
     return 0xdeadbeef;
@@ -8,6 +8,15 @@ static dllist_t tcb_list;
 //------------------------------------------------------------------------------
 // task operations
 
+// objects in pool have lock and list nodes reset, freed tcb is reset by
+// `task_cleanup` again, so `task_create` doesn't need to
+static void tcb_ctor(task_t * tid) {
+    tid->lock     = SPIN_INIT;
+    tid->dl_task  = DLNODE_INIT;
+    tid->dl_sched = DLNODE_INIT;
+    tid->dl_proc  = DLNODE_INIT;
+}
+
 // create new task
 task_t * task_create(const char * name, int priority, void * proc,
                      void * a1, void * a2, void * a3, void * a4) {
@@ -38,8 +47,6 @@ task_t * task_create(const char * name, int priority, void * proc,
     regs_init(&tid->regs, vstk + PAGE_SIZE * 16, proc, a1, a2, a3, a4);
 
     // TODO: lock tcb_list to prevent data racing
-    tid->lock      = SPIN_INIT;
-    tid->dl_task   = DLNODE_INIT;
     dl_push_tail(&tcb_list, &tid->dl_task);
     strncpy(tid->name, name, 63);
 
@@ -49,12 +56,10 @@ task_t * task_create(const char * name, int priority, void * proc,
     tid->last_cpu  = -1;
     tid->timeslice = 200;
     tid->remaining = 200;
-    tid->dl_sched  = DLNODE_INIT;
 
     tid->ret_val   = 0;
     tid->kstack    = kstk;
     tid->ustack    = NULL;
-    tid->dl_proc   = DLNODE_INIT;
     tid->process   = NULL;
 
     return tid;
@@ -87,6 +92,7 @@ static void task_cleanup(task_t * tid) {
     // TODO: signal parent for finish and wait
     // for the parent task to release this tcb
     dl_remove(&tcb_list, &tid->dl_task);
+    tcb_ctor(tid);
     pool_obj_free(&tcb_pool, tid);
 }
 
@@ -183,6 +189,6 @@ void task_dump() {
 // module setup
 
 __INIT void task_lib_init() {
-    pool_init(&tcb_pool, sizeof(task_t));
+    pool_init_ctor(&tcb_pool, sizeof(task_t), (pool_ctor_t) tcb_ctor, NULL);
     tcb_list = DLLIST_INIT;
 }
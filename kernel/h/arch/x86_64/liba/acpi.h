@@ -152,6 +152,61 @@ typedef struct mcfg {
     pci_conf_t  entries[0];
 } __PACKED mcfg_t;
 
+//------------------------------------------------------------------------------
+// srat and slit, for numa
+
+typedef struct srat {
+    acpi_tbl_t  header;
+    u32         reserved1;
+    u64         reserved2;
+} __PACKED srat_t;
+
+#define SRAT_TYPE_LOCAL_APIC            0
+#define SRAT_TYPE_MEMORY                1
+#define SRAT_TYPE_LOCAL_X2APIC          2
+
+#define SRAT_ENABLED        1   // bit 0 of flags, entry is valid
+
+// type = 0, Processor Local APIC Affinity
+typedef struct srat_loapic {
+    acpi_subtbl_t header;
+    u8            domain_lo;    // proximity domain [7:0]
+    u8            apic_id;
+    u32           flags;
+    u8            sapic_eid;
+    u8            domain_hi[3]; // proximity domain [31:8]
+    u32           clock_domain;
+} __PACKED srat_loapic_t;
+
+// type = 1, Memory Affinity
+typedef struct srat_memory {
+    acpi_subtbl_t header;
+    u32           domain;
+    u16           reserved1;
+    u64           base;
+    u64           length;
+    u32           reserved2;
+    u32           flags;
+    u64           reserved3;
+} __PACKED srat_memory_t;
+
+// type = 2, Processor Local x2APIC Affinity
+typedef struct srat_x2apic {
+    acpi_subtbl_t header;
+    u16           reserved1;
+    u32           domain;
+    u32           x2apic_id;
+    u32           flags;
+    u32           clock_domain;
+    u32           reserved2;
+} __PACKED srat_x2apic_t;
+
+typedef struct slit {
+    acpi_tbl_t  header;
+    u64         count;          // number of localities
+    u8          entries[0];     // count * count distance matrix
+} __PACKED slit_t;
+
 //------------------------------------------------------------------------------
 // hpet and fadt
 
@@ -172,6 +227,8 @@ extern madt_t * acpi_madt;
 extern mcfg_t * acpi_mcfg;
 extern fadt_t * acpi_fadt;
 extern hpet_t * acpi_hpet;
+extern srat_t * acpi_srat;
+extern slit_t * acpi_slit;
 
 // requires: nothing
 extern __INIT void acpi_tbl_init();
@@ -21,6 +21,12 @@ typedef struct regs {
     u64           cr3;      // current page table
 } __PACKED __ALIGNED(16) regs_t;
 
+// user registers saved by `syscall_entry` at the top of kernel stack
+typedef struct syscall_frame {
+    u64 r15;    u64 r14;    u64 r13;    u64 r12;
+    u64 rflags; u64 rsp;    u64 rip;    u64 rbp;    u64 zero;
+} __PACKED syscall_frame_t;
+
 typedef void (* isr_proc_t) (int vec, int_frame_t * sp);
 
 // global data
@@ -30,6 +36,10 @@ extern            u64 percpu_base;
 extern            u64 percpu_size;
 extern __PERCPU   int int_depth;
 extern __PERCPU   u64 int_rsp;
+extern __PERCPU   int cpu_node;
+extern            int support_pcid;
+extern            int support_invpcid;
+extern            int support_1gpage;
 extern isr_proc_t     isr_tbl[];
 
 //------------------------------------------------------------------------------
@@ -90,6 +100,26 @@ static inline void io_wait() {
 static inline void cpu_sleep() { ASM("hlt"); }
 static inline void cpu_relax() { ASM("pause"); }
 static inline void cpu_fence() { ASM("mfence" ::: "memory"); }
+
+static inline u64 read_tsc() {
+    union { u32 d[2]; u64 q; } u;
+    ASM("rdtsc" : "=d"(u.d[1]), "=a"(u.d[0]));
+    return u.q;
+}
+
+// clear memory with non-temporal stores, without polluting cache
+// `dst` must be 8-byte aligned and `len` must be multiple of 32
+static inline void memzero_nt(void * dst, usize len) {
+    u64 * p = (u64 *) dst;
+    for (usize i = 0; i < len / 8; i += 4) {
+        ASM("movnti %1,  0(%0)\n\t"
+            "movnti %1,  8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)" :: "r"(p + i), "r"(0UL) : "memory");
+    }
+    ASM("sfence" ::: "memory");
+}
+
 static inline void cpuid(u32 * a, u32 * b, u32 * c, u32 * d) {
     u32 eax, ebx, ecx, edx;
     if (NULL == a) { eax = 0; a = &eax; }
@@ -100,6 +130,12 @@ static inline void cpuid(u32 * a, u32 * b, u32 * c, u32 * d) {
                 :  "a"(*a),  "b"(*b),  "c"(*c),  "d"(*d));
 }
 
+// invalidate TLB entry of `va` tagged by `pcid`, requires INVPCID
+static inline void invpcid_addr(u64 pcid, u64 va) {
+    struct { u64 pcid; u64 va; } desc = { pcid, va };
+    ASM("invpcid %0, %1" :: "m"(desc), "r"(0UL) : "memory");
+}
+
 // read msr registers
 static inline u64 read_msr(u32 msr) {
     union { u32 d[2]; u64 q; } u;
@@ -179,6 +215,7 @@ extern        void int_unlock (u32 key);
 
 extern void  task_switch   ();
 extern void  return_to_user(usize ip, usize sp);
+extern void  return_from_fork(syscall_frame_t * frame);
 extern void  regs_init     (regs_t * regs, usize sp, void * proc,
                             void * a1, void * a2, void * a3, void * a4);
 extern void  regs_ctx_set  (regs_t * regs, usize ctx);
@@ -187,4 +224,8 @@ extern void  regs_ret_set  (regs_t * regs, usize val);
 extern usize regs_ret_get  (regs_t * regs);
 extern void  smp_reschedule(int cpu);
 
+static inline syscall_frame_t * regs_syscall_frame(regs_t * regs) {
+    return (syscall_frame_t *) (regs->rsp0 - sizeof(syscall_frame_t));
+}
+
 #endif // ARCH_X86_64_LIBA_CPU_H
\ No newline at end of file
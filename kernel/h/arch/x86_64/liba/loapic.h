@@ -15,6 +15,7 @@ typedef struct madt_loapic_mni madt_loapic_mni_t;
 #define VECNUM_SPURIOUS 0xff
 
 extern u8   loapic_get_id  ();
+extern int  loapic_get_node(int cpu);
 extern void loapic_send_eoi();
 extern void loapic_emit_ipi(int cpu, int vec);
 
@@ -22,6 +23,7 @@ extern void loapic_emit_ipi(int cpu, int vec);
 extern __INIT void loapic_override(u64 addr);
 extern __INIT void loapic_dev_add (madt_loapic_t * tbl);
 extern __INIT void loapic_set_nmi (madt_loapic_mni_t * tbl);
+extern __INIT void loapic_set_node(u32 apic_id, int node);
 extern __INIT void loapic_dev_init();
 extern __INIT void loapic_emit_init(int cpu);
 extern __INIT void loapic_emit_sipi(int cpu, int vec);
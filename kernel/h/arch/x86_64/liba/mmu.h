@@ -7,16 +7,40 @@
 #define MMU_RDONLY  2   // user code cannot write
 #define MMU_NOEXEC  4   // all code cannot execute
 
+// flush the whole TLB if more pages than this are invalidated
+#define FLUSH_BATCH 32
+
+// TLB entries to be invalidated, and page tables to be freed after that
+// collected while changing page tables, maybe under lock, and flushed by
+// `mmu_flush` after the lock is dropped
+typedef struct mmu_batch {
+    u32   count;                // greater than FLUSH_BATCH means all
+    usize addrs[FLUSH_BATCH];
+    pfn_t tables;               // linked through `page.next`
+} mmu_batch_t;
+
+#define MMU_BATCH_INIT ((mmu_batch_t) { .count = 0, .tables = NO_PAGE })
+
 extern usize mmu_ctx_get();
 extern void  mmu_ctx_set(usize ctx);
 
 extern usize mmu_ctx_create();
+extern void  mmu_ctx_destroy(usize ctx);
 extern usize mmu_translate(usize ctx, usize va);
-extern void  mmu_map(usize ctx, usize va, usize pa, usize n, u32 attr);
-extern void  mmu_unmap(usize ctx, usize va, usize n);
+extern int   mmu_is_empty(usize ctx, usize va, usize n);
+extern int   mmu_map(usize ctx, usize va, usize pa, usize n, u32 attr, mmu_batch_t * batch);
+extern int   mmu_unmap(usize ctx, usize va, usize n, mmu_batch_t * batch);
+extern int   mmu_protect(usize ctx, usize va, usize n, u32 attr, mmu_batch_t * batch);
+extern void  mmu_flush(usize ctx, mmu_batch_t * batch);
+
+// TLB shootdown, requested by other cpus
+extern void  mmu_flush_proc();
+
+// requires: nothing
+extern __INIT void kernel_ctx_add_io(usize pa, usize size);
 
 // requires: page-array
-extern __INIT void kernel_ctx_init();
+extern __INIT void kernel_ctx_init(u8 * mmap_buf, u32 mmap_len);
 extern __INIT void kernel_ctx_load();
 
 #endif // ARCH_X86_64_LIBA_MMU_H
@@ -6,6 +6,9 @@
 typedef struct rbnode rbnode_t;
 typedef struct rbtree rbtree_t;
 
+// recompute augmented data of a node from its children
+typedef void (* rb_augment_t) (rbnode_t * node);
+
 struct rbnode {
     usize      parent_color;
     rbnode_t * left;
@@ -13,16 +16,18 @@ struct rbnode {
 } __ALIGNED(sizeof(usize));
 
 struct rbtree {
-    rbnode_t * root;
+    rbnode_t *   root;
+    rb_augment_t augment;   // optional, called when subtree changes
 };
 
 #define RBNODE_INIT ((rbnode_t) { 0, 0, 0 })
-#define RBTREE_INIT ((rbtree_t) { 0 })
+#define RBTREE_INIT ((rbtree_t) { 0, 0 })
 
 extern void rb_link_node(rbnode_t * node, rbnode_t * parent, rbnode_t ** rb_link);
 extern void rb_insert_fixup(rbtree_t * tree, rbnode_t * node);
 extern void rb_erase(rbtree_t * tree, rbnode_t * node);
 extern void rb_replace(rbtree_t * tree, rbnode_t * victim, rbnode_t * node);
+extern void rb_augment_path(rbtree_t * tree, rbnode_t * node);
 
 extern rbnode_t * rb_first(rbtree_t * tree);
 extern rbnode_t * rb_last (rbtree_t * tree);
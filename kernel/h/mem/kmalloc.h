@@ -0,0 +1,16 @@
+#ifndef MEM_KMALLOC_H
+#define MEM_KMALLOC_H
+
+#include <base.h>
+
+// largest size served by pools, larger requests use whole pages
+#define KMALLOC_MAX     2048
+
+extern void * kmalloc(usize size);
+extern void   kfree  (void * ptr);
+extern usize  ksize  (void * ptr);
+
+// requires: pool, page-array
+extern __INIT void kmalloc_lib_init();
+
+#endif // MEM_KMALLOC_H
@@ -3,6 +3,7 @@
 
 #include <base.h>
 #include <arch.h>
+#include <libk/list.h>
 
 // page descriptor, one for each physical page frame
 // we cram multiple fields into flags, making page_t more compact
@@ -12,11 +13,17 @@ typedef struct page {
     u32   type  : 4;
     u32   order : 4;            // only valid when block=1
     u32   block : 1;            // is it the first page in block
+    u32   node  : 3;            // numa node this page belongs to
+    u32   tag   : 8;            // pool defined, kmalloc size class
+    u32   color : 8;            // pool slab color, in cache lines
     union {
         struct {                // pool
             u16 objects;        // first free object
             u16 inuse;          // number of allocated objects
         };
+        u32 pages;              // kmalloc, number of pages
+        u32 refs;               // shared user page, number of mappings
+        u32 entries;            // page table, number of present entries
     };
 } page_t;
 
@@ -29,10 +36,17 @@ typedef struct page {
 #define PT_KSTACK       5       // task's kernel stack page
 #define PT_PIPE         6       // buffer space of pipe
 #define PT_FIFOBUF      7       // FIFO buffer
+#define PT_ZEROED       8       // free and cleared, in zero pool
+#define PT_KMALLOC      9       // first page of large kmalloc range
+#define PT_SHARED       10      // user page shared after fork, refcounted
+#define PT_PGTABLE      11      // page table of user space, entries counted
 
 // block order
 #define ORDER_COUNT     16
 
+// numa node limit, must fit in page_t.node
+#define MAX_NODE_COUNT  8
+
 // container of several pages, used to keep track of memory usage
 typedef struct pglist {
     pfn_t head;
@@ -45,19 +59,44 @@ typedef struct pglist {
 // memory zone bit masks
 #define ZONE_DMA        1
 #define ZONE_NORMAL     2
+#define ZONE_ZERO       4       // not a zone, request cleared pages
+
+// shrinker gives back memory when free pages are low
+// return number of pages freed
+typedef usize (* shrink_proc_t) (void * arg);
+
+typedef struct shrinker {
+    dlnode_t      dl;
+    shrink_proc_t proc;
+    void *        arg;
+    int           refs;         // number of cpus calling it
+    int           dead;         // being unregistered, not called anymore
+} shrinker_t;
 
 extern page_t * page_array;
 extern usize    page_count;
+extern int      node_count;
 
 // page frame allocator
 extern pfn_t page_block_alloc(u32 zones, int order);
 extern void  page_block_free (pfn_t blk, int order);
 extern pfn_t page_range_alloc(u32 zones, int count);
 extern void  page_range_free (pfn_t rng, int count);
+extern int   page_list_alloc (u32 zones, usize count, pglist_t * list);
+extern void  page_list_free  (pglist_t * list);
 extern pfn_t page_alloc      (u32 zones);
 extern void  page_free       (pfn_t page);
 extern usize free_page_count (u32 zones);
+extern usize free_node_page_count(int node);
 extern void  dump_page_layout(u32 zones);
+extern void  page_cache_drain();
+extern u32   page_defer_step ();
+extern int   page_defer_run  ();
+extern int   page_zero_fill  ();
+extern usize page_reclaim    ();
+
+extern void  shrinker_regist  (shrinker_t * shrinker, void * proc, void * arg);
+extern void  shrinker_unregist(shrinker_t * shrinker);
 
 // page list operations
 extern void  pglist_push_head(pglist_t * list, pfn_t page);
@@ -68,7 +107,16 @@ extern void  pglist_remove   (pglist_t * list, pfn_t page);
 extern void  pglist_free_all (pglist_t * list);
 
 // requires: nothing
-extern __INIT void page_lib_init ();
-extern __INIT void page_range_add(usize start, usize end);
+extern __INIT void  page_lib_init   ();
+extern __INIT void  page_node_add   (int node, usize start, usize end);
+extern __INIT void  page_node_dist  (int from, int to, int dist);
+extern __INIT pfn_t page_defer_setup(usize reserved);
+extern __INIT void  page_range_add  (usize start, usize end);
+
+// requires: percpu-var
+extern __INIT void page_cache_init();
+
+// requires: task, sched
+extern __INIT void page_reclaim_init();
 
 #endif // MEM_PAGE_H
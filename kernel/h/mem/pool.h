@@ -5,19 +5,52 @@
 #include <mem/page.h>
 #include <libk/spin.h>
 
+typedef struct magazine magazine_t;
+typedef void (* pool_ctor_t) (void * obj);
+
+// largest object a pool could hold, 8K, two pages
+#define POOL_OBJ_MAX    (PAGE_SIZE * 2)
+
+// partial slabs are grouped by occupancy into this many buckets
+#define PARTIAL_COUNT   8
+
 typedef struct pool {
-    spin_t   lock;
-    u32      obj_size;
-    pglist_t full;          // all objects not allocated
-    pglist_t empty;         // all objects allocated
-    pglist_t partial;       // some objects allocated
+    spin_t       lock;
+    u32          obj_size;
+    u32          obj_count;     // objects per slab
+    u32          link;          // offset of freelist link within object
+    int          order;         // page order of each slab
+    u32          color_count;   // number of different slab offsets
+    u32          color_next;    // color of next slab, protected by lock
+    pool_ctor_t  ctor;          // called on objects when slab is created
+    pool_ctor_t  dtor;          // called on objects when slab is freed
+    int          id;            // index of percpu magazines, -1 for none
+    u8           tag;           // saved in `page_t` of each slab
+    pglist_t     full;          // all objects not allocated
+    pglist_t     empty;         // all objects allocated
+    pglist_t     partial[PARTIAL_COUNT];    // some objects allocated
+    u32          partial_mask;  // bit set for non-empty partial list
+    magazine_t * depot_full;    // full magazines, protected by lock
+    magazine_t * depot_empty;   // empty magazines, protected by lock
+    shrinker_t   shrinker;      // free unused slabs when memory is low
 } pool_t;
 
-extern void pool_init   (pool_t * pool, u32 obj_size);
-extern void pool_destroy(pool_t * pool);
-extern void pool_shrink (pool_t * pool);
+extern void  pool_init   (pool_t * pool, u32 obj_size);
+extern void  pool_init_ctor(pool_t * pool, u32 obj_size,
+                            pool_ctor_t ctor, pool_ctor_t dtor);
+extern void  pool_destroy(pool_t * pool);
+extern usize pool_shrink (pool_t * pool);
 
 extern void * pool_obj_alloc(pool_t * pool);
 extern void   pool_obj_free (pool_t * pool, void * obj);
+extern void   pool_dump     (pool_t * pool);
+
+// requires: percpu-var
+extern __INIT void pool_lib_init();
+
+#ifdef POOL_BENCH
+// requires: kmalloc
+extern __INIT void pool_bench();
+#endif
 
 #endif // MEM_POOL_H
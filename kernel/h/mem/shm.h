@@ -0,0 +1,33 @@
+#ifndef MEM_SHM_H
+#define MEM_SHM_H
+
+#include <base.h>
+#include <mem/page.h>
+#include <libk/list.h>
+
+#define SHM_NAME_LEN 32
+
+// named memory object, could be mapped into multiple vmspaces
+// the object lives as long as it is mapped by any process
+// unnamed objects are created by kernel, not in the list of all objects
+typedef struct shm {
+    dlnode_t dl;                    // node in the list of all objects
+    char     name[SHM_NAME_LEN];    // empty if unnamed
+    usize    size;                  // aligned to page size
+    u32      refs;                  // number of mappings
+    u32      flags;                 // SHM_xxx
+    pglist_t pages;                 // backing pages, zero filled
+} shm_t;
+
+// object flags
+#define SHM_RDONLY  1               // never mapped writable
+
+extern shm_t * shm_get  (const char * name, usize size);
+extern shm_t * shm_alloc(usize size, u32 flags);
+extern void    shm_hold (shm_t * shm);
+extern void    shm_put  (shm_t * shm);
+
+// requires: nothing
+extern __INIT void shm_lib_init();
+
+#endif // MEM_SHM_H
@@ -3,29 +3,51 @@
 
 #include <base.h>
 #include <mem/page.h>
+#include <mem/shm.h>
 #include <libk/spin.h>
-#include <libk/list.h>
+#include <libk/rbtree.h>
 
 // represents a process
 typedef struct vmspace {
     spin_t   lock;
     usize    ctx;
-    dllist_t ranges;
+    rbtree_t ranges;    // all ranges indexed by address
+    usize    faults;    // pages populated by page fault
+    u32      unflushed; // TLB flushes pending after lock is given back
+    usize    brk_base;  // start of heap window, NO_ADDR if no heap
+    usize    brk;       // end of heap, the program break
 } vmspace_t;
 
 // represents a continuous range in the process 
 typedef struct vmrange {
-    dlnode_t dl;        // node in vmspace.ranges
+    rbnode_t rb;        // node in vmspace.ranges
     usize    addr;      // start address, aligned to page size
     usize    size;      // range size, aligned to page size
     u32      type;      // free or used
+    usize    max_free;  // size of largest free range in subtree
+    u32      flags;     // VM_xxx
     pglist_t pages;     // list of mapped pages
+    shm_t  * shm;       // shared memory object mapped, or NULL
 } vmrange_t;
 
 // range type
 #define RT_FREE 0
 #define RT_USED 1
 
+// range flags
+#define VM_DEMAND   1   // pages not populated are allocated on fault
+#define VM_SHARED   2   // may contain shared pages, copy on write
+#define VM_RDONLY   4   // user cannot write
+#define VM_NOEXEC   8   // user cannot execute
+#define VM_NOACCESS 16  // user cannot access at all
+#define VM_MMAP     32  // created by mmap, could be split
+#define VM_SHM      64  // maps a shared memory object
+#define VM_HEAP     128 // heap window, only pages below break are usable
+#define VM_HUGE     256 // demand faults may populate a whole 2M page
+
+// address space reserved for heap, right after the program image
+#define HEAP_SIZE   0x100000000UL
+
 extern void        vmspace_init    (vmspace_t * space);
 extern void        vmspace_destroy (vmspace_t * space);
 extern int         vmspace_add_free(vmspace_t * space, usize addr, usize size);
@@ -34,8 +56,18 @@ extern vmrange_t * vmspace_alloc   (vmspace_t * space, usize size);
 extern vmrange_t * vmspace_alloc_at(vmspace_t * space, usize addr, usize size);
 extern void        vmspace_free    (vmspace_t * space, vmrange_t * range);
 extern int         vmspace_is_free (vmspace_t * space, usize addr, usize size);
-extern int         vmspace_map     (vmspace_t * space, vmrange_t * range);
-extern void        vmspace_unmap   (vmspace_t * space, vmrange_t * range);
+extern int         vmspace_map     (vmspace_t * space, vmrange_t * range, u32 flags);
+extern int         vmspace_populate(vmspace_t * space, vmrange_t * range, usize size);
+extern int         vmspace_map_shm (vmspace_t * space, vmrange_t * range, shm_t * shm);
+extern int         vmspace_unmap   (vmspace_t * space, vmrange_t * range);
+extern int         vmspace_fault   (vmspace_t * space, usize va, int write);
+extern vmrange_t * vmspace_find    (vmspace_t * space, usize va);
+extern int         vmspace_fork    (vmspace_t * dst, vmspace_t * src);
+extern int         vmspace_free_at (vmspace_t * space, usize addr, usize size);
+extern int         vmspace_protect (vmspace_t * space, usize addr, usize size, u32 flags);
+extern int         vmspace_heap_init(vmspace_t * space, usize addr);
+extern usize       vmspace_brk     (vmspace_t * space, usize brk);
+extern usize       vmspace_sbrk    (vmspace_t * space, ssize incr);
 
 // requires: nothing
 extern __INIT void vmspace_lib_init();
@@ -16,7 +16,9 @@
 
 #include <mem/page.h>
 #include <mem/pool.h>
+#include <mem/kmalloc.h>
 #include <mem/vmspace.h>
+#include <mem/shm.h>
 
 #include <drvs/ios.h>
 #include <drvs/kbd.h>
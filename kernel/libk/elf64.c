@@ -1,41 +1,96 @@
 #include <wheel.h>
 
 // copy to a bunch of memory represented by the page list
-// if there are space left, fill them with zero
+// `offset` is where to start copying within the first block
+// pages are already cleared by `vmspace_populate`, so space left is zero
 // return the number of bytes not copied
 usize copy_to_pglist(pglist_t * pages, u8 * buff, usize len, usize offset) {
-    pfn_t blk = pages->head;
-
-    // copy buffer to the page list
-    while ((NO_PAGE != blk) && (len > 0)) {
-        dbg_assert(offset < PAGE_SIZE);
+    for (pfn_t blk = pages->head; NO_PAGE != blk; blk = page_array[blk].next) {
         dbg_assert(1 == page_array[blk].block);
 
         u8  * addr = (u8 *) phys_to_virt((usize) blk << PAGE_SHIFT);
         usize size = PAGE_SIZE << page_array[blk].order;
+        dbg_assert(offset < size);
+
+        // blocks may have different size
         usize copy = MIN(len, size - offset);
         memcpy(addr + offset, buff, copy);
 
-        buff   += copy;
-        offset += copy;
-        len    -= copy;
-        offset -= size;
-        blk     = page_array[blk].next;
+        buff  += copy;
+        len   -= copy;
+        offset = 0;
     }
 
-    // fill the rest of page list with zero
-    while (NO_PAGE != blk) {
-        dbg_assert(1 == page_array[blk].block);
+    return len;
+}
 
-        u8  * addr = (u8 *) phys_to_virt((usize) blk << PAGE_SHIFT);
-        usize size = PAGE_SIZE << page_array[blk].order;
-        memset(addr + offset, 0, size - offset);
+// read-only segments of programs in ramfs, shared by all instances
+// ramfs never changes, so cached segments are kept forever
+typedef struct elf_seg {
+    dlnode_t dl;
+    u8     * elf;               // file content in ramfs
+    usize    vaddr;             // segment start, aligned to page size
+    shm_t  * shm;               // pages holding segment content
+} elf_seg_t;
+
+static spin_t   seg_lock = SPIN_INIT;
+static dllist_t seg_list = DLLIST_INIT;
+
+// lock should be held by caller
+static elf_seg_t * seg_lookup(u8 * elf, usize vaddr) {
+    for (dlnode_t * dl = seg_list.head; NULL != dl; dl = dl->next) {
+        elf_seg_t * seg = PARENT(dl, elf_seg_t, dl);
+        if ((seg->elf == elf) && (seg->vaddr == vaddr)) {
+            return seg;
+        }
+    }
+    return NULL;
+}
 
-        offset = 0;
-        blk    = page_array[blk].next;
+// get content of a read-only segment, loaded on first use
+// caller gets one reference to the object, return NULL on failure
+static shm_t * seg_get(u8 * elf, elf64_phdr_t * phdr, usize vm_start, usize vm_end) {
+    u32         key = irq_spin_take(&seg_lock);
+    elf_seg_t * seg = seg_lookup(elf, vm_start);
+    if (NULL != seg) {
+        shm_hold(seg->shm);
+        irq_spin_give(&seg_lock, key);
+        return seg->shm;
     }
+    irq_spin_give(&seg_lock, key);
 
-    return len;
+    // load without holding the lock
+    seg = (elf_seg_t *) kmalloc(sizeof(elf_seg_t));
+    if (NULL == seg) {
+        return NULL;
+    }
+    seg->dl    = DLNODE_INIT;
+    seg->elf   = elf;
+    seg->vaddr = vm_start;
+    seg->shm   = shm_alloc(vm_end - vm_start, SHM_RDONLY);
+    if (NULL == seg->shm) {
+        kfree(seg);
+        return NULL;
+    }
+    copy_to_pglist(&seg->shm->pages, elf + phdr->p_offset,
+                   phdr->p_filesz, phdr->p_vaddr - vm_start);
+
+    // another instance may have loaded it meanwhile
+    key = irq_spin_take(&seg_lock);
+    elf_seg_t * old = seg_lookup(elf, vm_start);
+    if (NULL != old) {
+        shm_hold(old->shm);
+        irq_spin_give(&seg_lock, key);
+        shm_put(seg->shm);
+        kfree(seg);
+        return old->shm;
+    }
+
+    // one reference held by cache, one by caller
+    shm_hold(seg->shm);
+    dl_push_tail(&seg_list, &seg->dl);
+    irq_spin_give(&seg_lock, key);
+    return seg->shm;
 }
 
 // load an elf file into the context of current process
@@ -71,7 +126,9 @@ int elf64_load(process_t * pid, u8 * elf, usize len) {
     }
 
     // calculate the number of pages required to hold this elf object
+    // heap starts right after the highest segment
     usize page_required = 0;
+    usize heap_start    = 0;
 
     // loop through each segment, make sure vmrange is usable
     for (int i = 0; i < hdr->e_phnum; ++i) {
@@ -83,11 +140,12 @@ int elf64_load(process_t * pid, u8 * elf, usize len) {
         // align segment to page boundry
         usize vm_start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
         usize vm_end   = ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
-        if (YES != vmspace_is_free(&pid->vm, vm_start, vm_end)) {
+        if (YES != vmspace_is_free(&pid->vm, vm_start, vm_end - vm_start)) {
             return ERROR;
         }
 
         page_required += (vm_end - vm_start) >> PAGE_SHIFT;
+        heap_start     = MAX(heap_start, vm_end);
     }
 
     // check if there's enough free page
@@ -95,8 +153,11 @@ int elf64_load(process_t * pid, u8 * elf, usize len) {
         return ERROR;
     }
 
-    // all vmranges allocated for this elf
-    vmrange_t * ranges[hdr->e_phnum];
+    // all vmranges allocated for this elf, too large for kernel stack
+    vmrange_t ** ranges = (vmrange_t **) kmalloc(hdr->e_phnum * sizeof(vmrange_t *));
+    if (NULL == ranges) {
+        return ERROR;
+    }
     memset(ranges, 0, hdr->e_phnum * sizeof(vmrange_t *));
 
     // loop through each segment again, allocate space and load the content
@@ -114,7 +175,27 @@ int elf64_load(process_t * pid, u8 * elf, usize len) {
         if (NULL == ranges[i]) {
             goto error;
         }
-        if (vmspace_map(&pid->vm, ranges[i])) {
+
+        // read-only segments are shared with other instances
+        if (0 == (phdr->p_flags & PF_W)) {
+            shm_t * shm = seg_get(elf, phdr, vm_start, vm_end);
+            if (NULL == shm) {
+                goto error;
+            }
+            ranges[i]->flags |= VM_RDONLY;
+            if (0 == (phdr->p_flags & PF_X)) {
+                ranges[i]->flags |= VM_NOEXEC;
+            }
+            if (OK != vmspace_map_shm(&pid->vm, ranges[i], shm)) {
+                shm_put(shm);
+                goto error;
+            }
+            continue;
+        }
+
+        // only file content is populated, bss is demand paged
+        usize filled = ROUND_UP(phdr->p_vaddr + phdr->p_filesz, PAGE_SIZE) - vm_start;
+        if (vmspace_populate(&pid->vm, ranges[i], filled)) {
             goto error;
         }
 
@@ -122,6 +203,12 @@ int elf64_load(process_t * pid, u8 * elf, usize len) {
                        phdr->p_filesz, phdr->p_vaddr - vm_start);
     }
 
+    // reserve heap window right after the last segment
+    if (OK != vmspace_heap_init(&pid->vm, heap_start)) {
+        goto error;
+    }
+    kfree(ranges);
+
     pid->entry = hdr->e_entry;
 
     // get section header table's offset
@@ -154,5 +241,6 @@ error:
         vmspace_unmap(&pid->vm, ranges[i]);
         vmspace_free(&pid->vm, ranges[i]);
     }
+    kfree(ranges);
     return ERROR;
 }
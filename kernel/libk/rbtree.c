@@ -2,6 +2,10 @@
 
 // for root nodes, parent == NULL
 // we don't have standalone node as Linux does
+//
+// augmented tree keeps per-subtree data in the containing struct, such as
+// max value in subtree. `tree->augment` recomputes one node from its
+// children, it is called on rotated nodes and along the changed path.
 
 #define RB_RED      0
 #define RB_BLACK    1
@@ -43,6 +47,11 @@ static void rb_rotate_left(rbnode_t * node, rbtree_t * tree) {
         parent->right = right;
     }
     rb_set_parent(node, right);
+
+    if (NULL != tree->augment) {
+        tree->augment(node);
+        tree->augment(right);
+    }
 }
 
 static void rb_rotate_right(rbnode_t * node, rbtree_t * tree) {
@@ -63,6 +72,11 @@ static void rb_rotate_right(rbnode_t * node, rbtree_t * tree) {
         parent->right = left;
     }
     rb_set_parent(node, left);
+
+    if (NULL != tree->augment) {
+        tree->augment(node);
+        tree->augment(left);
+    }
 }
 
 // insert new node into the red-black tree
@@ -75,6 +89,7 @@ void rb_link_node(rbnode_t * node, rbnode_t * parent, rbnode_t ** link) {
 // keep red-black properties after inserting a new node
 void rb_insert_fixup(rbtree_t * tree, rbnode_t * node) {
     rbnode_t * parent, * gparent, * uncle;
+    rb_augment_path(tree, node);
     while ((parent = RB_PARENT(node)) && (RB_RED == RB_COLOR(parent))) {
         gparent = RB_PARENT(parent);
         if (parent == gparent->left) {
@@ -250,6 +265,8 @@ void rb_erase(rbtree_t * tree, rbnode_t * node) {
     }
 
 color:
+    // nodes above the removed position have a different subtree now
+    rb_augment_path(tree, parent);
     if (RB_BLACK == color) {
         rb_erase_fixup(tree, child, parent);
     }
@@ -278,6 +295,17 @@ void rb_replace(rbtree_t * tree, rbnode_t * victim, rbnode_t * node) {
     *node = *victim;
 }
 
+// recompute augmented data from `node` up to the root, should be called
+// after the augmented value of `node` itself changes
+void rb_augment_path(rbtree_t * tree, rbnode_t * node) {
+    if (NULL == tree->augment) {
+        return;
+    }
+    for (; NULL != node; node = RB_PARENT(node)) {
+        tree->augment(node);
+    }
+}
+
 rbnode_t * rb_first(rbtree_t * tree) {
     rbnode_t * node = tree->root;
     if (NULL == node) {
@@ -0,0 +1,86 @@
+#include <wheel.h>
+
+// general purpose memory allocation, small sizes are rounded up to one of
+// the size classes below, each served by a pool. pool slabs are tagged
+// with class index, so `kfree` could find the pool from `page_t`.
+// larger requests are allocated as page ranges, page count is recorded
+// in the descriptor of the first page.
+
+static const u32 class_size[] = {
+    8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+#define CLASS_COUNT (sizeof(class_size) / sizeof(class_size[0]))
+
+static pool_t class_pool[CLASS_COUNT];
+static u8     class_index[KMALLOC_MAX / 8 + 1];  // size / 8 -> class
+
+void * kmalloc(usize size) {
+    if (0 == size) {
+        return NULL;
+    }
+
+    if (size <= KMALLOC_MAX) {
+        int c = class_index[(size + 7) >> 3];
+        return pool_obj_alloc(&class_pool[c]);
+    }
+
+    int   count = (int) (ROUND_UP(size, PAGE_SIZE) >> PAGE_SHIFT);
+    pfn_t rng   = page_range_alloc(ZONE_DMA|ZONE_NORMAL, count);
+    if (NO_PAGE == rng) {
+        return NULL;
+    }
+    for (int i = 0; i < count; ++i) {
+        page_array[rng + i].type = PT_KERNEL;
+    }
+    page_array[rng].type  = PT_KMALLOC;
+    page_array[rng].pages = count;
+    return phys_to_virt((usize) rng << PAGE_SHIFT);
+}
+
+void kfree(void * ptr) {
+    if (NULL == ptr) {
+        return;
+    }
+
+    pfn_t page = (pfn_t) (virt_to_phys(ptr) >> PAGE_SHIFT);
+    switch (page_array[page].type) {
+    case PT_POOL:
+        dbg_assert(page_array[page].tag > 0);
+        pool_obj_free(&class_pool[page_array[page].tag - 1], ptr);
+        break;
+    case PT_KMALLOC:
+        dbg_assert(((usize) ptr & (PAGE_SIZE - 1)) == 0);
+        page_range_free(page, page_array[page].pages);
+        break;
+    default:
+        dbg_print("[kfree] invalid pointer %llx.\n", ptr);
+        break;
+    }
+}
+
+// return usable size of the allocated memory
+usize ksize(void * ptr) {
+    pfn_t page = (pfn_t) (virt_to_phys(ptr) >> PAGE_SHIFT);
+    switch (page_array[page].type) {
+    case PT_POOL:    return class_size[page_array[page].tag - 1];
+    case PT_KMALLOC: return (usize) page_array[page].pages << PAGE_SHIFT;
+    default:         return 0;
+    }
+}
+
+__INIT void kmalloc_lib_init() {
+    for (u32 c = 0, i = 0; c < CLASS_COUNT; ++c) {
+        pool_init(&class_pool[c], class_size[c]);
+        class_pool[c].tag = c + 1;
+        for (; i * 8 <= class_size[c]; ++i) {
+            class_index[i] = c;
+        }
+    }
+
+    // smallest size served by page ranges, a single page
+    void * page = kmalloc(PAGE_SIZE);
+    dbg_assert(NULL != page);
+    dbg_assert(PAGE_SIZE == ksize(page));
+    kfree(page);
+}
@@ -6,52 +6,222 @@ usize    page_count = 0;        // number of page descriptors
 typedef struct zone {
     spin_t   lock;
     usize    page_count;
+    usize    present;           // number of pages managed by this zone
+    usize    low;               // below this, reclaim task starts working
+    usize    high;              // reclaim task stops above this
+    u32      orders;            // bit mask of non-empty block lists
     pglist_t list[ORDER_COUNT]; // block list of each order
 } zone_t;
 
+// dma zone is global, normal zone is created for each numa node
 static zone_t zone_dma;
-static zone_t zone_normal;
+static zone_t zone_normal[MAX_NODE_COUNT];
+
+// memory range of each numa node, from acpi srat
+typedef struct node_range {
+    pfn_t start;
+    pfn_t end;
+    int   node;
+} node_range_t;
+
+#define MAX_RANGE_COUNT 32
+
+static node_range_t node_ranges[MAX_RANGE_COUNT];
+static int          range_count;
+
+int node_count = 1;
+static u8 node_dist [MAX_NODE_COUNT][MAX_NODE_COUNT];
+static u8 node_order[MAX_NODE_COUNT][MAX_NODE_COUNT]; // fallback, near to far
+
+// per-cpu cache of order-0 pages, only holds pages from local normal zone
+// recently freed (hot) pages are at the head, cold pages are at the tail
+typedef struct page_cache {
+    int      count;
+    pglist_t list;
+} page_cache_t;
+
+#define CACHE_LOW       16      // refill up to this many pages when empty
+#define CACHE_HIGH      64      // drain when holding more pages than this
+#define CACHE_BATCH     16      // number of pages drained at once
+
+static __PERCPU page_cache_t page_cache;
+static int percpu_ready = NO;
+
+// pre-zeroed pages of each node, filled by idle cpus
+typedef struct zero_pool {
+    spin_t   lock;
+    int      count;
+    pglist_t list;
+} zero_pool_t;
+
+#define ZERO_POOL_SIZE  256     // max pages kept zeroed per node
+#define ZERO_LIST_MAX   512     // larger list requests prefer big blocks
+
+static zero_pool_t zero_pool[MAX_NODE_COUNT];
+static shrinker_t  zero_shrinker;
+
+// registered shrinkers, called when memory is low
+// reclaim task checks watermarks periodically
+#define RECLAIM_INTERVAL    100     // ticks between two checks
+#define WMARK_SHIFT         8       // low watermark is 1/256 of zone
+#define WMARK_MIN           32      // but at least this many pages
+#define RECLAIM_RETRY       8       // direct reclaim rounds before giving up
+
+static spin_t   shrinker_lock;
+static dllist_t shrinker_list;
+static u32      reclaim_wanted = NO;
+
+// page descriptors above `defer_start` are not initialized during boot,
+// they are filled section by section later, by all cpus in parallel or
+// lazily when allocation fails. section is the size of largest block, so
+// a block and its buddy always lie in the same section.
+typedef struct defer_range {
+    pfn_t start;
+    pfn_t end;
+} defer_range_t;
+
+#define SECTION_SIZE    (1U << (ORDER_COUNT - 1))
+#define BOOT_PAGES      ((256UL << 20) >> PAGE_SHIFT)   // 256M for booting
+#define MAX_DEFER_COUNT 64
+
+static defer_range_t defer_ranges[MAX_DEFER_COUNT];
+static int           defer_count   = 0;
+static pfn_t         defer_start   = NO_PAGE;
+static u32           defer_total   = 0;     // number of deferred sections
+static u32           defer_next    = 0;     // next section to initialize
+static u32           defer_done    = 0;     // sections initialized
 
 //------------------------------------------------------------------------------
-// allocate a block from zone, no spinlock protection
+// helper functions
 
-static pfn_t zone_block_alloc(zone_t * zone, int order) {
-    for (int o = order; o < ORDER_COUNT; ++o) {
-        if ((NO_PAGE == zone->list[o].head) &&
-            (NO_PAGE == zone->list[o].tail)) {
-            // this order has no free block, try bigger ones
-            continue;
-        }
+// find the zone a page belongs to
+static inline zone_t * zone_of(pfn_t page) {
+    if (page < (DMA_END >> PAGE_SHIFT)) {
+        return &zone_dma;
+    }
+    return &zone_normal[page_array[page].node];
+}
 
-        // found an order with free block, remove its first element
-        pfn_t blk = pglist_pop_head(&zone->list[o]);
+// numa node of current cpu, before percpu area is ready, use node 0
+static inline int local_node() {
+    if (YES == percpu_ready) {
+        return thiscpu_var(cpu_node);
+    }
+    return 0;
+}
 
-        // split the block, and return the second half back
-        // return second half, so base address remain unchanged
-        for (; o > order; --o) {
-            usize size = 1UL << (o - 1);
-            pfn_t bud  = blk ^ size;
-            page_array[bud].block = 1;
-            page_array[bud].order = o - 1;
+//------------------------------------------------------------------------------
+// pre-zeroed page pool
 
-            // return buddy block to the list
-            pglist_push_head(&zone->list[o-1], bud);
+// take one zeroed page from local node, or any node if local one is empty
+static pfn_t zero_pool_pop() {
+    int   node = local_node();
+    pfn_t page = NO_PAGE;
+    for (int i = 0; (NO_PAGE == page) && (i < node_count); ++i) {
+        zero_pool_t * pool = &zero_pool[node_order[node][i]];
+        if (0 == pool->count) {
+            continue;
         }
+        u32 key = irq_spin_take(&pool->lock);
+        page = pglist_pop_head(&pool->list);
+        if (NO_PAGE != page) {
+            --pool->count;
+        }
+        irq_spin_give(&pool->lock, key);
+    }
+
+    if (NO_PAGE != page) {
+        page_array[page].type  = PT_KERNEL;
+        page_array[page].block = 1;
+        page_array[page].order = 0;
+    }
+    return page;
+}
 
-        // mark this block as allocated
-        usize size = 1U << order;
-        zone->page_count -= size;
-        for (pfn_t i = 0; i < size; ++i) {
-            page_array[blk + i].type = PT_KERNEL;
+// return all pre-zeroed pages to buddy system, when memory is low
+// registered as a shrinker, return number of pages given back
+static usize zero_pool_drain(void * arg __UNUSED) {
+    usize given = 0;
+    for (int i = 0; i < node_count; ++i) {
+        zero_pool_t * pool = &zero_pool[i];
+        if (0 == pool->count) {
+            continue;
         }
+        u32 key = irq_spin_take(&pool->lock);
+        pglist_t list = pool->list;
+        given += pool->count;
+        pool->list  = PGLIST_INIT;
+        pool->count = 0;
+        irq_spin_give(&pool->lock, key);
 
-        page_array[blk].block = 1;
-        page_array[blk].order = 1;
-        return blk;
+        page_list_free(&list);
     }
+    return given;
+}
 
-    // no block that big
-    return NO_PAGE;
+//------------------------------------------------------------------------------
+// block list of each order, keeping `zone->orders` in sync
+
+static inline void zone_list_push(zone_t * zone, int order, pfn_t blk) {
+    pglist_push_head(&zone->list[order], blk);
+    zone->orders |= 1U << order;
+}
+
+static inline pfn_t zone_list_pop(zone_t * zone, int order) {
+    pfn_t blk = pglist_pop_head(&zone->list[order]);
+    if (NO_PAGE == zone->list[order].head) {
+        zone->orders &= ~(1U << order);
+    }
+    return blk;
+}
+
+static inline void zone_list_remove(zone_t * zone, int order, pfn_t blk) {
+    pglist_remove(&zone->list[order], blk);
+    if (NO_PAGE == zone->list[order].head) {
+        zone->orders &= ~(1U << order);
+    }
+}
+
+//------------------------------------------------------------------------------
+// allocate a block from zone, no spinlock protection
+
+static pfn_t zone_block_alloc(zone_t * zone, int order) {
+    // find the smallest order with free block
+    u32 mask = zone->orders & ~((1U << order) - 1);
+    if (0 == mask) {
+        // no block that big
+        return NO_PAGE;
+    }
+
+    // found an order with free block, remove its first element
+    int   o   = CTZ32(mask);
+    pfn_t blk = zone_list_pop(zone, o);
+
+    // split the block, and return the second half back
+    // return second half, so base address remain unchanged
+    for (; o > order; --o) {
+        usize size = 1UL << (o - 1);
+        pfn_t bud  = blk ^ size;
+        page_array[bud].block = 1;
+        page_array[bud].order = o - 1;
+
+        // return buddy block to the list
+        zone_list_push(zone, o - 1, bud);
+    }
+
+    // mark this block as allocated, wake up reclaim task if memory is low
+    usize size = 1U << order;
+    zone->page_count -= size;
+    if (zone->page_count < zone->low) {
+        reclaim_wanted = YES;
+    }
+    for (pfn_t i = 0; i < size; ++i) {
+        page_array[blk + i].type = PT_KERNEL;
+    }
+
+    page_array[blk].block = 1;
+    page_array[blk].order = order;
+    return blk;
 }
 
 static void zone_block_free(zone_t * zone, pfn_t blk, u32 order) {
@@ -63,10 +233,17 @@ static void zone_block_free(zone_t * zone, pfn_t blk, u32 order) {
     }
 
     // merging into bigger block
+    // if block list of this order is empty, buddy cannot be free
     for (; order < ORDER_COUNT - 1; ++order) {
+        if (0 == (zone->orders & (1U << order))) {
+            break;
+        }
+
         size = 1U << order;
         pfn_t bud = blk ^ size;
-        if ((PT_FREE != page_array[bud].type)  ||
+        if ((bud >= page_count)                ||
+            (zone != zone_of(bud))             ||
+            (PT_FREE != page_array[bud].type)  ||
             (1       != page_array[bud].block) ||
             (order   != page_array[bud].order)) {
             // cannot merge with buddy
@@ -74,7 +251,7 @@ static void zone_block_free(zone_t * zone, pfn_t blk, u32 order) {
         }
 
         // remove buddy from block list
-        pglist_remove(&zone->list[order], bud);
+        zone_list_remove(zone, order, bud);
 
         // merge with its buddy
         page_array[bud].block = 0;
@@ -87,60 +264,182 @@ static void zone_block_free(zone_t * zone, pfn_t blk, u32 order) {
     page_array[blk].order = order;
 
     // put this block into the block list
-    pglist_push_head(&zone->list[order], blk);
+    zone_list_push(zone, order, blk);
 }
 
 //------------------------------------------------------------------------------
-// page frame allocator public routines
+// per-cpu page cache, caller need to lock interrupt
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wtype-limits"
-static inline zone_t * zone_for(usize start, usize end) {
-    if ((DMA_START <= start) && (end <= DMA_END)) {
-        return &zone_dma;
+// move pages from local zone into the cache, under one lock acquisition
+static void cache_refill(page_cache_t * cache, zone_t * zone) {
+    raw_spin_take(&zone->lock);
+    while (cache->count < CACHE_LOW) {
+        pfn_t page = zone_block_alloc(zone, 0);
+        if (NO_PAGE == page) {
+            break;
+        }
+        page_array[page].type = PT_CACHED;
+        pglist_push_tail(&cache->list, page);
+        ++cache->count;
     }
-    if ((NORMAL_START <= start) && (end <= NORMAL_END)) {
-        return &zone_normal;
+    raw_spin_give(&zone->lock);
+}
+
+// return `count` cold pages back to local zone, under one lock acquisition
+// pages go back to their own zone, cache might be filled before cpu_node set
+static void cache_drain(page_cache_t * cache, int count) {
+    zone_t * zone = NULL;
+    for (; (count > 0) && (cache->count > 0); --count) {
+        pfn_t    page = pglist_pop_tail(&cache->list);
+        zone_t * next = zone_of(page);
+        if (next != zone) {
+            if (NULL != zone) {
+                raw_spin_give(&zone->lock);
+            }
+            zone = next;
+            raw_spin_take(&zone->lock);
+        }
+        zone_block_free(zone, page, 0);
+        --cache->count;
+    }
+    if (NULL != zone) {
+        raw_spin_give(&zone->lock);
     }
-    return NULL;
 }
-#pragma GCC diagnostic pop
 
-// allocate page block of size 2^order
+static pfn_t cache_alloc() {
+    page_cache_t * cache = thiscpu_ptr(page_cache);
+    if (0 == cache->count) {
+        cache_refill(cache, &zone_normal[local_node()]);
+    }
+
+    pfn_t page = pglist_pop_head(&cache->list);
+    if (NO_PAGE != page) {
+        --cache->count;
+        page_array[page].type  = PT_KERNEL;
+        page_array[page].block = 1;
+        page_array[page].order = 0;
+    }
+    return page;
+}
+
+static void cache_free(pfn_t page) {
+    page_cache_t * cache = thiscpu_ptr(page_cache);
+    page_array[page].type  = PT_CACHED;
+    page_array[page].block = 1;
+    page_array[page].order = 0;
+    pglist_push_head(&cache->list, page);
+    ++cache->count;
+
+    if (cache->count > CACHE_HIGH) {
+        cache_drain(cache, CACHE_BATCH);
+    }
+}
+
+// return all pages cached on current cpu back to local zone
+void page_cache_drain() {
+    if (YES != percpu_ready) {
+        return;
+    }
+
+    u32 key = int_lock();
+    page_cache_t * cache = thiscpu_ptr(page_cache);
+    cache_drain(cache, cache->count);
+    int_unlock(key);
+}
+
+//------------------------------------------------------------------------------
+// page frame allocator public routines
+
+// allocate page block of size 2^order, never defer or reclaim
+// normal zones are tried from local node to the farthest one
 // lock zone and interrupt, so ISR could alloc pages
-pfn_t page_block_alloc(u32 zones, int order) {
-    if ((order < 0) || (order >= ORDER_COUNT)) {
-        return NO_PAGE; // invalid parameter
+static pfn_t block_try_alloc(u32 zones, int order) {
+
+    u32 key  = int_lock();
+    int node = local_node();
+
+    // single pages are served by percpu cache first
+    if ((0 == order) && (zones & ZONE_NORMAL) && (YES == percpu_ready)) {
+        pfn_t page = cache_alloc();
+        if (NO_PAGE != page) {
+            int_unlock(key);
+            return page;
+        }
     }
 
     if (zones & ZONE_NORMAL) {
-        u32 key = irq_spin_take(&zone_normal.lock);
-        pfn_t blk = zone_block_alloc(&zone_normal, order);
-        irq_spin_give(&zone_normal.lock, key);
-        dbg_assert((blk & ((1U << order) - 1)) == 0);
-        if (NO_PAGE != blk) {
-            return blk;
+        for (int i = 0; i < node_count; ++i) {
+            zone_t * zone = &zone_normal[node_order[node][i]];
+            raw_spin_take(&zone->lock);
+            pfn_t blk = zone_block_alloc(zone, order);
+            raw_spin_give(&zone->lock);
+            dbg_assert((blk & ((1U << order) - 1)) == 0);
+            if (NO_PAGE != blk) {
+                int_unlock(key);
+                return blk;
+            }
         }
     }
 
     if (zones & ZONE_DMA) {
-        u32 key = irq_spin_take(&zone_dma.lock);
+        raw_spin_take(&zone_dma.lock);
         pfn_t blk = zone_block_alloc(&zone_dma, order);
-        irq_spin_give(&zone_dma.lock, key);
+        raw_spin_give(&zone_dma.lock);
         dbg_assert((blk & ((1U << order) - 1)) == 0);
         if (NO_PAGE != blk) {
+            int_unlock(key);
             return blk;
         }
     }
 
-    // no block is large enough
+    int_unlock(key);
     return NO_PAGE;
 }
 
+// allocate page block of size 2^order
+// if no block is large enough, try initializing more memory
+// or reclaim pages directly, then try again
+static pfn_t block_alloc(u32 zones, int order) {
+    if ((order < 0) || (order >= ORDER_COUNT)) {
+        return NO_PAGE; // invalid parameter
+    }
+
+    // pages freed by reclaim might be taken by others, or might not merge
+    // into a block large enough, so reclaim only a few rounds
+    for (int retry = 0; ; ) {
+        pfn_t blk = block_try_alloc(zones, order);
+        if (NO_PAGE != blk) {
+            return blk;
+        }
+        if (0 != page_defer_step()) {
+            continue;
+        }
+        if ((retry++ >= RECLAIM_RETRY) || (0 == page_reclaim())) {
+            return NO_PAGE;
+        }
+    }
+}
+
+// allocate page block of size 2^order, with `ZONE_ZERO` the content is
+// cleared, single pages are taken from the pre-zeroed pool if possible
+pfn_t page_block_alloc(u32 zones, int order) {
+    if ((zones & ZONE_ZERO) && (zones & ZONE_NORMAL) && (0 == order)) {
+        pfn_t page = zero_pool_pop();
+        if (NO_PAGE != page) {
+            return page;
+        }
+    }
+
+    pfn_t blk = block_alloc(zones, order);
+    if ((NO_PAGE != blk) && (zones & ZONE_ZERO)) {
+        memset(phys_to_virt((usize) blk << PAGE_SHIFT), 0, PAGE_SIZE << order);
+    }
+    return blk;
+}
+
 void page_block_free(pfn_t blk, int order) {
     usize size = 1UL << order;
-    zone_t * zone = zone_for((usize)  blk         << PAGE_SHIFT,
-                             (usize) (blk + size) << PAGE_SHIFT);
     dbg_assert(order >= 0);
     dbg_assert(order < ORDER_COUNT);
     if (0 != (blk & (size - 1))) {
@@ -148,17 +447,168 @@ void page_block_free(pfn_t blk, int order) {
         dbg_print("%x, %d.\n", blk, order);
     }
     dbg_assert(0 == (blk & (size - 1)));
-    dbg_assert(NULL != zone);
+    dbg_assert(blk + size <= page_count);
+
+    zone_t * zone = zone_of(blk);
+    dbg_assert(zone == zone_of(blk + size - 1));
+
+    u32 key = int_lock();
+
+    // single pages of local node go back to percpu cache
+    if ((0 == order) && (YES == percpu_ready) &&
+        (&zone_normal[local_node()] == zone)) {
+        cache_free(blk);
+        int_unlock(key);
+        return;
+    }
 
     raw_spin_take(&zone->lock);
     zone_block_free(zone, blk, order);
     raw_spin_give(&zone->lock);
+    int_unlock(key);
+}
+
+// return all blocks in the list, taking zone lock only when zone changes
+// blocks are merged directly into the zone, skipping percpu cache
+void page_list_free(pglist_t * list) {
+    zone_t * zone = NULL;
+    u32      key  = int_lock();
+
+    for (pfn_t blk = list->head; NO_PAGE != blk;) {
+        dbg_assert(1 == page_array[blk].block);
+        pfn_t next  = page_array[blk].next;
+        int   order = page_array[blk].order;
+
+        zone_t * z = zone_of(blk);
+        if (z != zone) {
+            if (NULL != zone) {
+                raw_spin_give(&zone->lock);
+            }
+            zone = z;
+            raw_spin_take(&zone->lock);
+        }
+
+        zone_block_free(zone, blk, order);
+        blk = next;
+    }
+
+    if (NULL != zone) {
+        raw_spin_give(&zone->lock);
+    }
+    int_unlock(key);
+
+    list->head = NO_PAGE;
+    list->tail = NO_PAGE;
+}
+
+// allocate up to `count` pages from one zone, append blocks to `list`
+// return the number of pages still required
+static usize zone_list_alloc(zone_t * zone, usize count, pglist_t * list) {
+    raw_spin_take(&zone->lock);
+    while (count > 0) {
+        // take the largest free block not exceeding `count`
+        // if there's none, split a larger block
+        int order = MIN(63 - CLZ64(count), ORDER_COUNT - 1);
+        u32 mask  = zone->orders & ((2U << order) - 1);
+        if (0 != mask) {
+            order = 31 - CLZ32(mask);
+        }
+
+        pfn_t blk = zone_block_alloc(zone, order);
+        if (NO_PAGE == blk) {
+            break;
+        }
+        pglist_push_tail(list, blk);
+        count -= 1UL << order;
+    }
+    raw_spin_give(&zone->lock);
+    return count;
+}
+
+// append all pages in `src` to the tail of `dst`
+static void pglist_concat(pglist_t * dst, pglist_t * src) {
+    if (NO_PAGE == src->head) {
+        return;
+    }
+    if (NO_PAGE == dst->tail) {
+        dst->head = src->head;
+    } else {
+        page_array[dst->tail].next = src->head;
+        page_array[src->head].prev = dst->tail;
+    }
+    dst->tail = src->tail;
+}
+
+// take `count` pages from zero pool and zones into `zero` and `blks`
+// never defer or reclaim, return the number of pages still required
+static usize list_try_alloc(u32 zones, usize count, pglist_t * zero, pglist_t * blks) {
+    usize left = count;
+
+    // small requests of zeroed pages are served by zero pool first
+    if ((zones & ZONE_ZERO) && (zones & ZONE_NORMAL) && (count < ZERO_LIST_MAX)) {
+        pfn_t page;
+        while ((left > 0) && (NO_PAGE != (page = zero_pool_pop()))) {
+            pglist_push_tail(zero, page);
+            --left;
+        }
+    }
+
+    u32 key  = int_lock();
+    int node = local_node();
+    for (int i = 0; (left > 0) && (zones & ZONE_NORMAL) && (i < node_count); ++i) {
+        left = zone_list_alloc(&zone_normal[node_order[node][i]], left, blks);
+    }
+    if ((left > 0) && (zones & ZONE_DMA)) {
+        left = zone_list_alloc(&zone_dma, left, blks);
+    }
+    int_unlock(key);
+    return left;
+}
+
+// allocate `count` pages as a list of blocks, appended to `list`
+// each zone is locked only once, return ERROR if not enough pages
+int page_list_alloc(u32 zones, usize count, pglist_t * list) {
+    pglist_t zero = PGLIST_INIT;
+    pglist_t blks = PGLIST_INIT;
+
+    // give back partial result, initialize more memory or reclaim, retry
+    for (int retry = 0; 0 != list_try_alloc(zones, count, &zero, &blks); ) {
+        page_list_free(&zero);
+        page_list_free(&blks);
+        if (0 != page_defer_step()) {
+            continue;
+        }
+        if ((retry++ >= RECLAIM_RETRY) || (0 == page_reclaim())) {
+            return ERROR;
+        }
+    }
+
+    // blocks not from zero pool are cleared here
+    if (zones & ZONE_ZERO) {
+        for (pfn_t blk = blks.head; NO_PAGE != blk; blk = page_array[blk].next) {
+            memset(phys_to_virt((usize) blk << PAGE_SHIFT), 0,
+                   PAGE_SIZE << page_array[blk].order);
+        }
+    }
+
+    // concatenate allocated blocks to the tail of `list`
+    pglist_concat(list, &zero);
+    pglist_concat(list, &blks);
+    return OK;
 }
 
 pfn_t page_range_alloc(u32 zones, int count) {
+    if (count <= 0) {
+        return NO_PAGE;
+    }
+
     // allocate a block that is large enough, then return the exceeding part
-    int order = 32 - CLZ32(count - 1);
+    // CLZ32(0) is undefined, single page is order 0
+    int order = (1 == count) ? 0 : 32 - CLZ32(count - 1);
     pfn_t rng = page_block_alloc(zones, order);
+    if (NO_PAGE == rng) {
+        return NO_PAGE;
+    }
     page_range_free(rng + count, (1U << order) - count);
     return rng;
 }
@@ -191,13 +641,144 @@ void page_free(pfn_t page) {
     page_block_free(page, 0);
 }
 
+//------------------------------------------------------------------------------
+// shrinker and memory reclaim
+
+void shrinker_regist(shrinker_t * shrinker, void * proc, void * arg) {
+    shrinker->dl   = DLNODE_INIT;
+    shrinker->proc = (shrink_proc_t) proc;
+    shrinker->arg  = arg;
+    shrinker->refs = 0;
+    shrinker->dead = NO;
+
+    u32 key = irq_spin_take(&shrinker_lock);
+    dl_push_tail(&shrinker_list, &shrinker->dl);
+    irq_spin_give(&shrinker_lock, key);
+}
+
+// shrinker might be running on other cpus, wait until it returns
+void shrinker_unregist(shrinker_t * shrinker) {
+    u32 key = irq_spin_take(&shrinker_lock);
+    shrinker->dead = YES;
+    while (0 != shrinker->refs) {
+        irq_spin_give(&shrinker_lock, key);
+        cpu_relax();
+        key = irq_spin_take(&shrinker_lock);
+    }
+    dl_remove(&shrinker_list, &shrinker->dl);
+    irq_spin_give(&shrinker_lock, key);
+}
+
+// call all shrinkers, return number of pages freed
+// shrinkers are called without lock, each one is kept in the list by
+// reference count until it returns, so the next one could be found.
+// shrinkers must not allocate memory, and must not wait
+usize page_reclaim() {
+    usize      freed = 0;
+    u32        key   = irq_spin_take(&shrinker_lock);
+    dlnode_t * dl    = shrinker_list.head;
+    while (NULL != dl) {
+        shrinker_t * shrinker = PARENT(dl, shrinker_t, dl);
+        if (NO == shrinker->dead) {
+            ++shrinker->refs;
+            irq_spin_give(&shrinker_lock, key);
+            freed += shrinker->proc(shrinker->arg);
+            key = irq_spin_take(&shrinker_lock);
+            --shrinker->refs;
+        }
+        dl = dl->next;
+    }
+    irq_spin_give(&shrinker_lock, key);
+    return freed;
+}
+
+// is there any zone having less free pages than its watermark
+static int below_watermark(int high) {
+    if (zone_dma.page_count < (high ? zone_dma.high : zone_dma.low)) {
+        return YES;
+    }
+    for (int i = 0; i < node_count; ++i) {
+        zone_t * zone = &zone_normal[i];
+        if (zone->page_count < (high ? zone->high : zone->low)) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// background reclaim, keep free pages of each zone above low watermark
+static void reclaim_proc() {
+    while (1) {
+        task_delay(RECLAIM_INTERVAL);
+        if ((NO == atomic32_set(&reclaim_wanted, NO)) &&
+            (NO == below_watermark(NO))) {
+            continue;
+        }
+        while ((YES == below_watermark(YES)) && (0 != page_reclaim())) {}
+    }
+}
+
+// clear one free page and put it into local zero pool, called by idle
+// task. return NO if there's nothing to do, so caller could sleep
+int page_zero_fill() {
+    int           node = local_node();
+    zero_pool_t * pool = &zero_pool[node];
+    if (pool->count >= ZERO_POOL_SIZE) {
+        return NO;
+    }
+
+    // stop at low watermark, so filling never triggers reclaim, which
+    // drains the pool again. never defer or reclaim here either
+    zone_t * zone = &zone_normal[node];
+    if (zone->page_count <= zone->low) {
+        return NO;
+    }
+
+    pfn_t page = block_try_alloc(ZONE_NORMAL, 0);
+    if (NO_PAGE == page) {
+        return NO;
+    }
+    if (zone_of(page) != zone) {
+        page_block_free(page, 0);
+        return NO;
+    }
+
+    // use non-temporal store, zeroed page is not needed in cache now
+    memzero_nt(phys_to_virt((usize) page << PAGE_SHIFT), PAGE_SIZE);
+    page_array[page].type = PT_ZEROED;
+
+    u32 key = irq_spin_take(&pool->lock);
+    pglist_push_head(&pool->list, page);
+    ++pool->count;
+    irq_spin_give(&pool->lock, key);
+    return YES;
+}
+
+// number of free pages in the given numa node, including percpu caches
+// and zero pool
+usize free_node_page_count(int node) {
+    if ((node < 0) || (node >= node_count)) {
+        return 0;
+    }
+
+    usize count = zone_normal[node].page_count + zero_pool[node].count;
+    for (int i = 0; (YES == percpu_ready) && (i < cpu_activated); ++i) {
+        if (node == percpu_var(i, cpu_node)) {
+            count += percpu_ptr(i, page_cache)->count;
+        }
+    }
+    return count;
+}
+
 usize free_page_count(u32 zones) {
     usize count = 0;
     if (zones & ZONE_DMA) {
         count += zone_dma.page_count;
     }
     if (zones & ZONE_NORMAL) {
-        count += zone_normal.page_count;
+        for (int i = 0; i < node_count; ++i) {
+            count += free_node_page_count(i);
+        }
     }
     return count;
 }
@@ -223,8 +804,23 @@ void dump_page_layout(u32 zones) {
         dump_layout(&zone_dma);
     }
     if (zones & ZONE_NORMAL) {
-        dbg_print("== zone normal:\n");
-        dump_layout(&zone_normal);
+        // pages cached by other cpus are not shown in the block list
+        page_cache_drain();
+        for (int i = 0; i < node_count; ++i) {
+            dbg_print("== zone normal, node %d:\n", i);
+            dump_layout(&zone_normal[i]);
+        }
+        for (int i = 0; (YES == percpu_ready) && (i < cpu_activated); ++i) {
+            int count = percpu_ptr(i, page_cache)->count;
+            if (count) {
+                dbg_print("-- cpu %02d cached %d pages.\n", i, count);
+            }
+        }
+        for (int i = 0; i < node_count; ++i) {
+            if (zero_pool[i].count) {
+                dbg_print("-- node %d has %d zeroed pages.\n", i, zero_pool[i].count);
+            }
+        }
     }
 }
 
@@ -293,34 +889,223 @@ void pglist_remove(pglist_t * list, pfn_t page) {
 }
 
 void pglist_free_all(pglist_t * list) {
-    while (NO_PAGE != list->head) {
-        dbg_assert(1 == page_array[list->head].block);
-        pfn_t next = page_array[list->head].next;
-        page_block_free(list->head, page_array[list->head].order);
-        list->head = next;
-    }
-    list->tail = NO_PAGE;
+    page_list_free(list);
 }
 
 //------------------------------------------------------------------------------
 // initialize page frame allocator, initially no free page
 
-__INIT void page_lib_init() {
-    zone_dma.lock     = SPIN_INIT;
-    zone_normal.lock  = SPIN_INIT;
-    zone_dma.page_count     = 0;
-    zone_normal.page_count  = 0;
+static __INIT void zone_init(zone_t * zone) {
+    zone->lock       = SPIN_INIT;
+    zone->page_count = 0;
+    zone->present    = 0;
+    zone->low        = 0;
+    zone->high       = 0;
+    zone->orders     = 0;
     for (int i = 0; i < ORDER_COUNT; ++i) {
-        zone_dma.list[i].head     = NO_PAGE;
-        zone_dma.list[i].tail     = NO_PAGE;
-        zone_normal.list[i].head  = NO_PAGE;
-        zone_normal.list[i].tail  = NO_PAGE;
+        zone->list[i] = PGLIST_INIT;
+    }
+}
+
+// sort other nodes by distance, nearest first
+static __INIT void build_node_order(int node) {
+    for (int i = 0; i < node_count; ++i) {
+        int n = (node + i) % node_count;
+        int j = i;
+        for (; (j > 0) && (node_dist[node][node_order[node][j-1]] > node_dist[node][n]); --j) {
+            node_order[node][j] = node_order[node][j-1];
+        }
+        node_order[node][j] = n;
+    }
+}
+
+__INIT void page_lib_init() {
+    zone_init(&zone_dma);
+    for (int i = 0; i < MAX_NODE_COUNT; ++i) {
+        zone_init(&zone_normal[i]);
+        for (int j = 0; j < MAX_NODE_COUNT; ++j) {
+            node_dist[i][j] = (i == j) ? 10 : 20;
+        }
+    }
+    for (int i = 0; i < MAX_NODE_COUNT; ++i) {
+        zero_pool[i].lock  = SPIN_INIT;
+        zero_pool[i].count = 0;
+        zero_pool[i].list  = PGLIST_INIT;
+    }
+    node_count  = 1;
+    range_count = 0;
+    node_order[0][0] = 0;
+
+    shrinker_lock = SPIN_INIT;
+    shrinker_list = DLLIST_INIT;
+    shrinker_regist(&zero_shrinker, zero_pool_drain, NULL);
+}
+
+// register memory range of a numa node, called before page_range_add
+__INIT void page_node_add(int node, usize start, usize end) {
+    if ((node < 0) || (node >= MAX_NODE_COUNT) || (range_count >= MAX_RANGE_COUNT)) {
+        return;
+    }
+
+    node_ranges[range_count].start = (pfn_t) (start >> PAGE_SHIFT);
+    node_ranges[range_count].end   = (pfn_t) (end   >> PAGE_SHIFT);
+    node_ranges[range_count].node  = node;
+    ++range_count;
+
+    if (node >= node_count) {
+        node_count = node + 1;
+        for (int i = 0; i < node_count; ++i) {
+            build_node_order(i);
+        }
     }
 }
 
-// add a range of free memory
+// set relative distance between two nodes, local distance is 10
+__INIT void page_node_dist(int from, int to, int dist) {
+    if ((from < 0) || (from >= node_count) ||
+        (to   < 0) || (to   >= node_count)) {
+        return;
+    }
+    node_dist[from][to] = (u8) dist;
+    build_node_order(from);
+}
+
+// setup percpu page cache, must be called after percpu area is ready
+__INIT void page_cache_init() {
+    for (int i = 0; i < cpu_installed; ++i) {
+        page_cache_t * cache = percpu_ptr(i, page_cache);
+        cache->count = 0;
+        cache->list  = PGLIST_INIT;
+    }
+    percpu_ready = YES;
+}
+
+// start background reclaim task
+__INIT void page_reclaim_init() {
+    task_t * tid = task_create("reclaim", PRIORITY_NONRT, reclaim_proc, 0,0,0,0);
+    task_resume(tid);
+}
+
+// add pages to the zone and update its watermarks
+static void zone_grow(zone_t * zone, usize count) {
+    u32 key = int_lock();
+    raw_spin_take(&zone->lock);
+    zone->present += count;
+    zone->low  = MAX(zone->present >> WMARK_SHIFT, WMARK_MIN);
+    zone->high = zone->low * 2;
+    raw_spin_give(&zone->lock);
+    int_unlock(key);
+}
+
+// free a range of pages, split by numa node
+// pages not covered by any node range belong to node 0
+static void node_range_free(pfn_t from, pfn_t to) {
+    while (from < to) {
+        int   node = 0;
+        pfn_t stop = to;
+        for (int i = 0; i < range_count; ++i) {
+            node_range_t * r = &node_ranges[i];
+            if ((r->start <= from) && (from < r->end)) {
+                node = r->node;
+                stop = MIN(stop, r->end);
+            } else if ((from < r->start) && (r->start < stop)) {
+                stop = r->start;
+            }
+        }
+
+        for (pfn_t i = from; i < stop; ++i) {
+            page_array[i].node = node;
+        }
+
+        pfn_t dma = MAX(from, MIN(stop, DMA_END >> PAGE_SHIFT));
+        if (from < dma) {
+            zone_grow(&zone_dma, dma - from);
+        }
+        if (dma < stop) {
+            zone_grow(&zone_normal[node], stop - dma);
+        }
+
+        page_range_free(from, stop - from);
+        from = stop;
+    }
+}
+
+// decide how many page descriptors are initialized during boot, pages
+// from `reserved` to the returned pfn must be initialized by the caller
+__INIT pfn_t page_defer_setup(usize reserved) {
+    pfn_t boot = (pfn_t) (ROUND_UP(reserved, PAGE_SIZE) >> PAGE_SHIFT);
+    boot = ROUND_UP(MAX(boot, BOOT_PAGES), SECTION_SIZE);
+    if (boot >= page_count) {
+        defer_start = NO_PAGE;
+        defer_total = 0;
+        return (pfn_t) page_count;
+    }
+    defer_start = boot;
+    defer_total = (u32) ((page_count - boot + SECTION_SIZE - 1) / SECTION_SIZE);
+    return boot;
+}
+
+// add a range of free memory, pages above `defer_start` are only recorded
 __INIT void page_range_add(usize start, usize end) {
     pfn_t from = (pfn_t) (start >> PAGE_SHIFT);
     pfn_t to   = (pfn_t) (end   >> PAGE_SHIFT);
-    page_range_free(from, to - from);
+
+    if ((NO_PAGE != defer_start) && (to > defer_start)) {
+        pfn_t mid = MAX(from, defer_start);
+        if ((defer_count > 0) && (defer_ranges[defer_count-1].end == mid)) {
+            defer_ranges[defer_count-1].end = to;
+        } else if (defer_count < MAX_DEFER_COUNT) {
+            defer_ranges[defer_count].start = mid;
+            defer_ranges[defer_count].end   = to;
+            ++defer_count;
+        } else {
+            dbg_print("too many memory ranges, 0x%llx-0x%llx ignored.\n",
+                      (u64) mid << PAGE_SHIFT, (u64) to << PAGE_SHIFT);
+        }
+        to = mid;
+    }
+
+    node_range_free(from, to);
+}
+
+//------------------------------------------------------------------------------
+// deferred page array initialization
+
+// initialize one deferred section and free usable pages in it, return
+// number of sections done after this one, or 0 if no section is left
+u32 page_defer_step() {
+    if (atomic32_get(&defer_next) >= defer_total) {
+        return 0;
+    }
+    u32 sec = atomic32_inc(&defer_next);
+    if (sec >= defer_total) {
+        return 0;
+    }
+
+    pfn_t from = defer_start + sec * SECTION_SIZE;
+    pfn_t to   = (pfn_t) MIN(from + SECTION_SIZE, page_count);
+    memset(&page_array[from], 0, (to - from) * sizeof(page_t));
+    for (int i = 0; i < defer_count; ++i) {
+        pfn_t start = MAX(defer_ranges[i].start, from);
+        pfn_t end   = MIN(defer_ranges[i].end,   to);
+        for (pfn_t j = start; j < end; ++j) {
+            page_array[j].type = PT_KERNEL;
+        }
+        if (start < end) {
+            node_range_free(start, end);
+        }
+    }
+
+    return atomic32_inc(&defer_done) + 1;
+}
+
+// initialize deferred sections until none left, can run on multiple cpus
+// return YES if the last section is finished by current caller
+int page_defer_run() {
+    int last = NO;
+    u32 done;
+    while (0 != (done = page_defer_step())) {
+        last = (done == defer_total) ? YES : NO;
+    }
+    return last;
 }
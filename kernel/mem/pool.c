@@ -1,152 +1,570 @@
 #include <wheel.h>
 
-// in the pool there are 3 slab lists:
+// in the pool there are 3 kinds of slab lists:
 // - full list,     inuse = 0
-// - partial list,  inuse = ~
+// - partial lists, inuse = ~
 // - empty list,    inuse = MAX
-// among them, full and empty lists are stacks, partial list is ordered
-// partial slabs are sotred by inuse
-// slabs with larger inuse is stored to the tail
+// all lists are stacks. partial slabs are grouped into buckets by
+// occupancy `inuse / obj_count`, objects are allocated from the fullest
+// non-empty bucket, found with a bitmask. so slab moves are O(1).
+//
+// slab is a page block of `pool->order`, chosen to reduce wasted space
+// slab head is found by aligning object's page number down to the order
+//
+// unused space at slab end is used for coloring, first object of each slab
+// is shifted by different number of cache lines, so objects from different
+// slabs don't always compete for the same cache sets.
+//
+// free objects are linked through a u32 at `pool->link`, normally 0. with
+// ctor/dtor, link is placed after the object, so constructed state is kept
+// while the object is free.
 
-#define NO_OBJ ((u32) -1)
+#define NO_OBJ          ((u16) -1)  // freelist end, slab is at most 64K
 
-void pool_init(pool_t * pool, u32 obj_size) {
-    if (obj_size < 4) {
-        obj_size = 4;
+#define MAX_SLAB_ORDER  4           // objects offsets must fit in u16
+#define MIN_SLAB_OBJS   4           // at least this many objects per slab
+#define MAX_SLAB_WASTE  8           // accept 1/8 of slab unused
+
+#define COLOR_ALIGN     64          // cache line size
+#define MAX_COLOR_COUNT 256         // color saved in `page_t` as u8
+
+// magazine layer on top of slabs (bonwick's design):
+// each cpu holds two magazines for each pool, objects are allocated from
+// and freed to local magazines with only interrupt disabled. when both
+// are empty (or full), exchange with the depot under `pool->lock`.
+// magazines are only created on the allocation path, outside the section
+// with interrupt disabled. free falls back to slabs if none is empty.
+
+#define MAG_SIZE        30      // objects per magazine, 256 bytes in total
+#define MAX_POOL_COUNT  32      // pools beyond this have no magazine layer
+                                // ids of destroyed pools are reused
+
+struct magazine {
+    magazine_t * next;          // next magazine in depot
+    int          count;         // number of objects in this magazine
+    void *       objs[MAG_SIZE];
+};
+
+typedef struct pool_cpu {
+    magazine_t * loaded;        // objects are taken from this one
+    magazine_t * previous;      // either full or empty
+    usize        allocs;        // number of objects allocated
+    usize        frees;         // number of objects freed
+    usize        misses;        // number of depot exchanges
+} pool_cpu_t;
+
+static __PERCPU pool_cpu_t pool_cpus[MAX_POOL_COUNT];
+static spin_t pool_id_lock = SPIN_INIT;
+static u32    pool_id_used = 0; // bit set for each id in use
+static pool_t mag_pool;         // magazines themselves, no magazine layer
+
+static void * slab_obj_alloc(pool_t * pool);
+static void   slab_obj_free (pool_t * pool, void * obj);
+
+//------------------------------------------------------------------------------
+// partial slab buckets
+
+static inline int partial_index(pool_t * pool, u32 inuse) {
+    return (int) (inuse * PARTIAL_COUNT / pool->obj_count);
+}
+
+static void partial_add(pool_t * pool, pfn_t slab) {
+    int i = partial_index(pool, page_array[slab].inuse);
+    pglist_push_head(&pool->partial[i], slab);
+    pool->partial_mask |= 1U << i;
+}
+
+static void partial_del(pool_t * pool, pfn_t slab, int i) {
+    pglist_remove(&pool->partial[i], slab);
+    if (NO_PAGE == pool->partial[i].head) {
+        pool->partial_mask &= ~(1U << i);
     }
+}
 
-    if (obj_size > (PAGE_SIZE / 8)) {
-        dbg_print("[panic] pool obj-size too large!\n");
-        return;
+// find the smallest slab order with acceptable waste
+// if none is good enough, choose the one wasting least
+static int slab_order(u32 obj_size) {
+    int   best_order = MAX_SLAB_ORDER;
+    usize best_waste = (usize) -1;
+    for (int o = 0; o <= MAX_SLAB_ORDER; ++o) {
+        usize size  = PAGE_SIZE << o;
+        usize count = size / obj_size;
+        if (count < MIN_SLAB_OBJS) {
+            continue;
+        }
+
+        // compare waste ratio, `waste / size`
+        usize waste = size - count * obj_size;
+        if (waste * MAX_SLAB_WASTE <= size) {
+            return o;
+        }
+        if ((usize) -1 == best_waste ||
+            (waste << (MAX_SLAB_ORDER - o)) < best_waste) {
+            best_order = o;
+            best_waste = waste << (MAX_SLAB_ORDER - o);
+        }
     }
+    return best_order;
+}
 
+// initialize slab layer only, no magazine and no shrinker
+static void pool_setup(pool_t * pool, u32 obj_size,
+                       pool_ctor_t ctor, pool_ctor_t dtor) {
+    if (obj_size < 4) {
+        obj_size = 4;
+    }
     obj_size = ROUND_UP(obj_size, 8);
 
+    // put freelist link after the object, keep constructed state
+    pool->link = 0;
+    if ((NULL != ctor) || (NULL != dtor)) {
+        pool->link = obj_size;
+        obj_size  += 8;
+    }
+
     // initialize member variables
     pool->lock     = SPIN_INIT;
     pool->obj_size = obj_size;
+    pool->order    = slab_order(obj_size);
+    pool->obj_count = (PAGE_SIZE << pool->order) / obj_size;
+    pool->ctor     = ctor;
+    pool->dtor     = dtor;
+
+    // each cache line of unused space gives one more color
+    u32 slack = (PAGE_SIZE << pool->order) - pool->obj_count * obj_size;
+    pool->color_count = MIN(slack / COLOR_ALIGN + 1, MAX_COLOR_COUNT);
+    pool->color_next  = 0;
     pool->full     = PGLIST_INIT;
-    pool->partial  = PGLIST_INIT;
     pool->empty    = PGLIST_INIT;
+    for (int i = 0; i < PARTIAL_COUNT; ++i) {
+        pool->partial[i] = PGLIST_INIT;
+    }
+    pool->partial_mask = 0;
+    pool->depot_full  = NULL;
+    pool->depot_empty = NULL;
+    pool->id       = -1;
+    pool->tag      = 0;
 }
 
-void pool_destroy(pool_t * pool) {
-    pglist_free_all(&pool->full);
-    pglist_free_all(&pool->partial);
-    pglist_free_all(&pool->empty);
+void pool_init(pool_t * pool, u32 obj_size) {
+    pool_init_ctor(pool, obj_size, NULL, NULL);
+}
+
+// ctor is called once for each object when a new slab is created, dtor is
+// called when the slab is returned to page allocator. objects must be in
+// constructed state when freed back to the pool.
+void pool_init_ctor(pool_t * pool, u32 obj_size,
+                    pool_ctor_t ctor, pool_ctor_t dtor) {
+    if (obj_size > POOL_OBJ_MAX) {
+        dbg_print("[panic] pool obj-size too large!\n");
+        return;
+    }
+
+    pool_setup(pool, obj_size, ctor, dtor);
+    if (&mag_pool != pool) {
+        u32 key = irq_spin_take(&pool_id_lock);
+        if ((u32) -1 != pool_id_used) {
+            pool->id = CTZ32(~pool_id_used);
+            pool_id_used |= 1U << pool->id;
+        }
+        irq_spin_give(&pool_id_lock, key);
+
+        for (int i = 0; (pool->id >= 0) && (i < cpu_installed); ++i) {
+            memset(percpu_ptr(i, pool_cpus[pool->id]), 0, sizeof(pool_cpu_t));
+        }
+    }
+    shrinker_regist(&pool->shrinker, pool_shrink, pool);
 }
 
-void pool_shrink(pool_t * pool) {
-    pglist_free_all(&pool->full);
+// return objects in a list of magazines back to slabs, and free them
+static void mag_list_free(pool_t * pool, magazine_t * mag) {
+    while (NULL != mag) {
+        magazine_t * next = mag->next;
+        for (int i = 0; i < mag->count; ++i) {
+            slab_obj_free(pool, mag->objs[i]);
+        }
+        slab_obj_free(&mag_pool, mag);
+        mag = next;
+    }
 }
 
-// allocate an object from the pool
-// first try to get a free obj from partial, then full, if still
-// not available, then we create a new slab by requesting a new page.
-void * pool_obj_alloc(pool_t * pool) {
-    pfn_t slab = NO_PAGE;
-    u8 *  va   = NULL;
-
-    if ((NO_PAGE == pool->partial.head) &&
-        (NO_PAGE == pool->partial.tail)) {
-        if ((NO_PAGE == pool->full.head) &&
-            (NO_PAGE == pool->full.tail)) {
-            // partial list and full list both empty, request a new page
-            slab = page_block_alloc(ZONE_DMA | ZONE_NORMAL, 0);
-            page_array[slab].type    = PT_POOL;
-            page_array[slab].inuse   = 0;
-            page_array[slab].objects = 0;
-            page_array[slab].block   = 1;
-            page_array[slab].order   = 0;
-
-            // construct freelist
-            va = (u8 *) phys_to_virt((usize) slab << PAGE_SHIFT);
-            int obj_size  = pool->obj_size;
-            int obj_count = PAGE_SIZE / obj_size;
-            for (int i = 0; i < obj_count; ++i) {
-                * (u32 *) (va + i * obj_size) = (i + 1) * obj_size;
+// call dtor on every object, then free slabs, return number of pages freed
+static usize slab_list_free(pool_t * pool, pglist_t * list) {
+    usize count = 0;
+    for (pfn_t slab = list->head; NO_PAGE != slab; slab = page_array[slab].next) {
+        count += 1UL << pool->order;
+        if (NULL == pool->dtor) {
+            continue;
+        }
+        u8 * va = (u8 *) phys_to_virt((usize) slab << PAGE_SHIFT);
+        va += page_array[slab].color * COLOR_ALIGN;
+        for (u32 i = 0; i < pool->obj_count; ++i) {
+            pool->dtor(va + i * pool->obj_size);
+        }
+    }
+    pglist_free_all(list);
+    return count;
+}
+
+// pool must not be used anymore, so magazines on all cpus are freed
+void pool_destroy(pool_t * pool) {
+    shrinker_unregist(&pool->shrinker);
+    if (pool->id >= 0) {
+        for (int i = 0; i < cpu_installed; ++i) {
+            pool_cpu_t * pc = percpu_ptr(i, pool_cpus[pool->id]);
+            if (NULL != pc->loaded) {
+                pc->loaded->next = NULL;
+                mag_list_free(pool, pc->loaded);
             }
-            * (u32 *) (va + (obj_count - 1) * obj_size) = NO_OBJ;
-        } else {
-            // partial list empty, full list not empty
-            // take a page out from the full list
-            slab = pglist_pop_head(&pool->full);
+            if (NULL != pc->previous) {
+                pc->previous->next = NULL;
+                mag_list_free(pool, pc->previous);
+            }
+            pc->loaded   = NULL;
+            pc->previous = NULL;
         }
 
-        // push this page into the partial list
-        pglist_push_head(&pool->partial, slab);
+        u32 key = irq_spin_take(&pool_id_lock);
+        pool_id_used &= ~(1U << pool->id);
+        irq_spin_give(&pool_id_lock, key);
+        pool->id = -1;
+    }
+    mag_list_free(pool, pool->depot_full);
+    mag_list_free(pool, pool->depot_empty);
+    pool->depot_full  = NULL;
+    pool->depot_empty = NULL;
+    slab_list_free(pool, &pool->full);
+    slab_list_free(pool, &pool->empty);
+    for (int i = 0; i < PARTIAL_COUNT; ++i) {
+        slab_list_free(pool, &pool->partial[i]);
+    }
+    pool->partial_mask = 0;
+}
+
+// flush magazines in depot, then free all slabs without allocated objects
+// magazines held by cpus are not touched. return number of pages freed
+usize pool_shrink(pool_t * pool) {
+    u32 key = irq_spin_take(&pool->lock);
+    magazine_t * mags_full  = pool->depot_full;
+    magazine_t * mags_empty = pool->depot_empty;
+    pool->depot_full  = NULL;
+    pool->depot_empty = NULL;
+    irq_spin_give(&pool->lock, key);
+
+    mag_list_free(pool, mags_full);
+    mag_list_free(pool, mags_empty);
+
+    key = irq_spin_take(&pool->lock);
+    pglist_t full = pool->full;
+    pool->full = PGLIST_INIT;
+    irq_spin_give(&pool->lock, key);
+
+    return slab_list_free(pool, &full);
+}
+
+// allocate a new slab and build the freelist
+// every page in the slab is marked, so `kfree` works with tail pages
+static pfn_t slab_create(pool_t * pool, u32 color) {
+    pfn_t slab = page_block_alloc(ZONE_DMA | ZONE_NORMAL, pool->order);
+    if (NO_PAGE == slab) {
+        return NO_PAGE;
+    }
+
+    for (pfn_t i = 0; i < (1U << pool->order); ++i) {
+        page_array[slab + i].type = PT_POOL;
+        page_array[slab + i].tag  = pool->tag;
+    }
+    u32 first = color * COLOR_ALIGN;
+    page_array[slab].inuse   = 0;
+    page_array[slab].objects = (u16) first;
+    page_array[slab].block   = 1;
+    page_array[slab].order   = pool->order;
+    page_array[slab].color   = color;
+
+    u8 * va = (u8 *) phys_to_virt((usize) slab << PAGE_SHIFT) + first;
+    u32 obj_size  = pool->obj_size;
+    u32 obj_count = pool->obj_count;
+    for (u32 i = 0; i < obj_count; ++i) {
+        * (u32 *) (va + i * obj_size + pool->link) = first + (i + 1) * obj_size;
+        if (NULL != pool->ctor) {
+            pool->ctor(va + i * obj_size);
+        }
     }
+    * (u32 *) (va + (obj_count - 1) * obj_size + pool->link) = NO_OBJ;
+    return slab;
+}
 
-    // get the tail of partial list, but do not remove it from the list
-    slab = pool->partial.tail;
-    va   = (u8 *) phys_to_virt((usize) slab << PAGE_SHIFT);
+// allocate an object from slabs
+// first try to get a free obj from the fullest partial slab, then full,
+// if still not available, then we create a new slab by requesting a new page.
+static void * slab_obj_alloc(pool_t * pool) {
+    pfn_t slab = NO_PAGE;
+    int   idx  = -1;
+    u32   key  = irq_spin_take(&pool->lock);
+
+    if (0 != pool->partial_mask) {
+        // keep the slab in its bucket, move only if occupancy changes
+        idx  = 31 - CLZ32(pool->partial_mask);
+        slab = pool->partial[idx].head;
+    } else if (NO_PAGE != pool->full.head) {
+        // partial lists empty, full list not empty
+        // take a page out from the full list
+        slab = pglist_pop_head(&pool->full);
+    } else {
+        // partial lists and full list all empty, request a new page
+        // release the lock, so direct reclaim could shrink this pool
+        u32 color = pool->color_next;
+        pool->color_next = (color + 1) % pool->color_count;
+        irq_spin_give(&pool->lock, key);
+        slab = slab_create(pool, color);
+        if (NO_PAGE == slab) {
+            return NULL;
+        }
+        key = irq_spin_take(&pool->lock);
+    }
 
     // get the object in the freelist
-    u32 obj  = page_array[slab].objects;
-    u32 next = * (u32 *) (va + obj);
+    u8 * va   = (u8 *) phys_to_virt((usize) slab << PAGE_SHIFT);
+    u32  obj  = page_array[slab].objects;
+    u16  next = (u16) * (u32 *) (va + obj + pool->link);
     page_array[slab].objects = next;
     page_array[slab].inuse  += 1;
 
     if (next == NO_OBJ) {
         // all objects allocated, move this slab to empty list
-        pglist_remove(&pool->partial, slab);
+        if (idx >= 0) {
+            partial_del(pool, slab, idx);
+        }
         pglist_push_head(&pool->empty, slab);
+    } else if (idx != partial_index(pool, page_array[slab].inuse)) {
+        // slab is new to partial, or goes to a fuller bucket
+        if (idx >= 0) {
+            partial_del(pool, slab, idx);
+        }
+        partial_add(pool, slab);
     }
 
+    irq_spin_give(&pool->lock, key);
     return (void *) (va + obj);
 }
 
-// return an object to the pool, add to corresponding slab
-void pool_obj_free(pool_t * pool, void * obj) {
-    pfn_t slab = (pfn_t) (virt_to_phys(obj) >> PAGE_SHIFT);
+// return an object to the corresponding slab
+static void slab_obj_free(pool_t * pool, void * obj) {
+    usize pa     = virt_to_phys(obj);
+    usize mask   = (PAGE_SIZE << pool->order) - 1;
+    pfn_t slab   = (pfn_t) ((pa & ~mask) >> PAGE_SHIFT);
+    u16   offset = (u16) (pa & mask);
 
     dbg_assert(PT_POOL == page_array[slab].type);
-    dbg_assert(((usize) obj & (PAGE_SIZE - 1)) % pool->obj_size == 0);
+    dbg_assert(1 == page_array[slab].block);
+    dbg_assert(offset >= page_array[slab].color * COLOR_ALIGN);
+    dbg_assert((offset - page_array[slab].color * COLOR_ALIGN) % pool->obj_size == 0);
+
+    u32 key = irq_spin_take(&pool->lock);
 
     // add object to the freelist, and substract 1 from inuse
-    * (u32 *) obj = page_array[slab].objects;
-    page_array[slab].objects = (u16) ((usize) obj & (PAGE_SIZE - 1));
+    u32 * link = (u32 *) ((u8 *) obj + pool->link);
+    int   idx  = partial_index(pool, page_array[slab].inuse);
+    * link = page_array[slab].objects;
+    page_array[slab].objects = offset;
     page_array[slab].inuse  -= 1;
 
-    if (NO_OBJ == * (u32 *) obj) {
+    if (NO_OBJ == * link) {
         // slab state change from empty to partial, move into partial list
         pglist_remove(&pool->empty, slab);
-        pglist_push_tail(&pool->partial, slab);
+        partial_add(pool, slab);
     } else if (page_array[slab].inuse == 0) {
         // slab state change from partial to full, move into full list
-        pglist_remove(&pool->partial, slab);
+        partial_del(pool, slab, idx);
         pglist_push_head(&pool->full, slab);
-    } else {
-        // slab state didn't change, but `inuse` became smaller,
-        // so we may have to move this slab forward.
-        pfn_t prev = page_array[slab].prev;
-        while ((NO_PAGE != prev) && (page_array[slab].inuse < page_array[prev].inuse)) {
-            prev = page_array[prev].prev;
-        }
-
-        if (prev != page_array[slab].prev) {
-            // `prev` is not the direct predecessor, we can infer that:
-            // 1. partial is not empty, at least two items
-            // 2. `slab` is not the head of list
-            // 3. `prev` is not the tail of list
-
-            // first take `slab` out from the list
-            pglist_remove(&pool->partial, slab);
-
-            // then insert `slab` after `prev`
-            if (NO_PAGE == prev) {
-                pglist_push_head(&pool->partial, slab);
-            } else {
-                pfn_t next = page_array[prev].next;
-                page_array[slab].prev = prev;
-                page_array[slab].next = next;
-                page_array[prev].next = slab;
-                if (NO_PAGE != next) {
-                    page_array[next].prev = slab;
-                } else {
-                    pool->partial.tail = slab;
+    } else if (idx != partial_index(pool, page_array[slab].inuse)) {
+        // slab state didn't change, but goes to an emptier bucket
+        partial_del(pool, slab, idx);
+        partial_add(pool, slab);
+    }
+
+    irq_spin_give(&pool->lock, key);
+}
+
+//------------------------------------------------------------------------------
+// magazine layer
+
+// create an empty magazine for later frees, never called with int_lock
+static void depot_add_empty(pool_t * pool) {
+    magazine_t * mag = (magazine_t *) slab_obj_alloc(&mag_pool);
+    if (NULL == mag) {
+        return;
+    }
+    mag->count = 0;
+
+    u32 key = irq_spin_take(&pool->lock);
+    mag->next = pool->depot_empty;
+    pool->depot_empty = mag;
+    irq_spin_give(&pool->lock, key);
+}
+
+// allocate an object from local magazines, fall back to slabs
+void * pool_obj_alloc(pool_t * pool) {
+    if (pool->id < 0) {
+        return slab_obj_alloc(pool);
+    }
+
+    u32          key = int_lock();
+    pool_cpu_t * pc  = thiscpu_ptr(pool_cpus[pool->id]);
+    ++pc->allocs;
+
+    if ((NULL == pc->loaded) || (0 == pc->loaded->count)) {
+        if ((NULL != pc->previous) && (pc->previous->count > 0)) {
+            // previous magazine is full, swap with loaded one
+            magazine_t * mag = pc->loaded;
+            pc->loaded   = pc->previous;
+            pc->previous = mag;
+        } else {
+            // both empty, get a full magazine from depot
+            ++pc->misses;
+            raw_spin_take(&pool->lock);
+            magazine_t * full = pool->depot_full;
+            if (NULL != full) {
+                pool->depot_full = full->next;
+                if (NULL != pc->previous) {
+                    pc->previous->next = pool->depot_empty;
+                    pool->depot_empty  = pc->previous;
                 }
+                pc->previous = pc->loaded;
+                pc->loaded   = full;
+            }
+            raw_spin_give(&pool->lock);
+        }
+    }
+
+    if ((NULL != pc->loaded) && (pc->loaded->count > 0)) {
+        void * obj = pc->loaded->objs[--pc->loaded->count];
+        int_unlock(key);
+        return obj;
+    }
+
+    int_unlock(key);
+
+    // objects from slabs will be freed to magazines, prepare one
+    if (NULL == pool->depot_empty) {
+        depot_add_empty(pool);
+    }
+    return slab_obj_alloc(pool);
+}
+
+// return an object to local magazines, fall back to slabs
+void pool_obj_free(pool_t * pool, void * obj) {
+    if (pool->id < 0) {
+        slab_obj_free(pool, obj);
+        return;
+    }
+
+    u32          key = int_lock();
+    pool_cpu_t * pc  = thiscpu_ptr(pool_cpus[pool->id]);
+    ++pc->frees;
+
+    if ((NULL == pc->loaded) || (MAG_SIZE == pc->loaded->count)) {
+        if ((NULL != pc->previous) && (0 == pc->previous->count)) {
+            // previous magazine is empty, swap with loaded one
+            magazine_t * mag = pc->loaded;
+            pc->loaded   = pc->previous;
+            pc->previous = mag;
+        } else {
+            // both full, get an empty magazine from depot
+            ++pc->misses;
+            raw_spin_take(&pool->lock);
+            magazine_t * empty = pool->depot_empty;
+            if (NULL != empty) {
+                pool->depot_empty = empty->next;
             }
+            raw_spin_give(&pool->lock);
+
+            // no empty magazine in depot, never allocate here
+            if (NULL == empty) {
+                int_unlock(key);
+                slab_obj_free(pool, obj);
+                return;
+            }
+
+            // put full magazine into depot
+            if (NULL != pc->previous) {
+                raw_spin_take(&pool->lock);
+                pc->previous->next = pool->depot_full;
+                pool->depot_full   = pc->previous;
+                raw_spin_give(&pool->lock);
+            }
+            pc->previous = pc->loaded;
+            pc->loaded   = empty;
+        }
+    }
+
+    pc->loaded->objs[pc->loaded->count++] = obj;
+    int_unlock(key);
+}
+
+// show allocation statistics of the pool, used to tune magazine size
+void pool_dump(pool_t * pool) {
+    usize allocs = 0;
+    usize frees  = 0;
+    usize misses = 0;
+    for (int i = 0; (pool->id >= 0) && (i < cpu_activated); ++i) {
+        pool_cpu_t * pc = percpu_ptr(i, pool_cpus[pool->id]);
+        allocs += pc->allocs;
+        frees  += pc->frees;
+        misses += pc->misses;
+    }
+    dbg_print("-- pool %d, obj-size %u: %llu allocs, %llu frees, %llu misses.\n",
+              pool->id, pool->obj_size, allocs, frees, misses);
+}
+
+#ifdef POOL_BENCH
+
+// measure the cost of slab free with increasing number of partial slabs.
+// all slabs are filled, then one object freed from each slab so they are
+// all partial, and the second round of free is timed.
+__INIT void pool_bench() {
+    static const u32 slab_counts[] = { 16, 256, 4096 };
+
+    for (int n = 0; n < 3; ++n) {
+        u32    slabs = slab_counts[n];
+        pool_t pool;
+        pool_setup(&pool, 64, NULL, NULL);
+
+        u32     total = slabs * pool.obj_count;
+        void ** objs  = (void **) kmalloc(total * sizeof(void *));
+        if (NULL == objs) {
+            dbg_print("~ pool bench: out of memory.\n");
+            return;
+        }
+        for (u32 i = 0; i < total; ++i) {
+            objs[i] = slab_obj_alloc(&pool);
+        }
+
+        // objects of the same slab are continuous in `objs`
+        for (u32 i = 0; i < slabs; ++i) {
+            slab_obj_free(&pool, objs[i * pool.obj_count]);
+        }
+        u64 start = read_tsc();
+        for (u32 i = 0; i < slabs; ++i) {
+            slab_obj_free(&pool, objs[i * pool.obj_count + 1]);
+        }
+        u64 cycles = read_tsc() - start;
+
+        dbg_print("~ pool bench: %u slabs, %llu cycles per free.\n",
+                  slabs, cycles / slabs);
+
+        kfree(objs);
+        slab_list_free(&pool, &pool.full);
+        slab_list_free(&pool, &pool.empty);
+        for (int i = 0; i < PARTIAL_COUNT; ++i) {
+            slab_list_free(&pool, &pool.partial[i]);
         }
     }
 }
+
+#endif // POOL_BENCH
+
+__INIT void pool_lib_init() {
+    pool_id_used = 0;
+    pool_init(&mag_pool, sizeof(magazine_t));
+}
@@ -0,0 +1,102 @@
+#include <wheel.h>
+
+static pool_t   shm_pool;
+static spin_t   shm_lock = SPIN_INIT;
+static dllist_t shm_list = DLLIST_INIT;
+
+// lock should be held by caller
+static shm_t * shm_lookup(const char * name) {
+    for (dlnode_t * dl = shm_list.head; NULL != dl; dl = dl->next) {
+        shm_t * shm = PARENT(dl, shm_t, dl);
+        if (0 == strncmp(shm->name, name, SHM_NAME_LEN)) {
+            return shm;
+        }
+    }
+    return NULL;
+}
+
+// create an object with zero filled pages, but not in the list yet
+static shm_t * shm_create(usize size, u32 flags) {
+    shm_t * shm = (shm_t *) pool_obj_alloc(&shm_pool);
+    shm->dl      = DLNODE_INIT;
+    shm->name[0] = '\0';
+    shm->size    = size;
+    shm->refs    = 1;
+    shm->flags   = flags;
+    shm->pages   = PGLIST_INIT;
+
+    // content is visible to user, pages must be cleared
+    if (OK != page_list_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO,
+                              size >> PAGE_SHIFT, &shm->pages)) {
+        pool_obj_free(&shm_pool, shm);
+        return NULL;
+    }
+    return shm;
+}
+
+// find the object with given name, or create a new one if not found
+// existing object must be no smaller than `size`. return NULL on failure
+shm_t * shm_get(const char * name, usize size) {
+    usize len = strlen(name);
+    if ((0 == size) || (0 == len) || (len >= SHM_NAME_LEN)) {
+        return NULL;
+    }
+    size = ROUND_UP(size, PAGE_SIZE);
+
+    u32     key = irq_spin_take(&shm_lock);
+    shm_t * shm = shm_lookup(name);
+    if (NULL != shm) {
+        if (shm->size < size) {
+            shm = NULL;
+        } else {
+            ++shm->refs;
+        }
+        irq_spin_give(&shm_lock, key);
+        return shm;
+    }
+
+    shm = shm_create(size, 0);
+    if (NULL != shm) {
+        strncpy(shm->name, name, SHM_NAME_LEN);
+        dl_push_tail(&shm_list, &shm->dl);
+    }
+    irq_spin_give(&shm_lock, key);
+    return shm;
+}
+
+// create an unnamed object, only reachable through the returned pointer
+shm_t * shm_alloc(usize size, u32 flags) {
+    if (0 == size) {
+        return NULL;
+    }
+    return shm_create(ROUND_UP(size, PAGE_SIZE), flags);
+}
+
+// add one more mapping to the object
+void shm_hold(shm_t * shm) {
+    u32 key = irq_spin_take(&shm_lock);
+    dbg_assert(shm->refs > 0);
+    ++shm->refs;
+    irq_spin_give(&shm_lock, key);
+}
+
+// drop one mapping, free the object when no process maps it
+void shm_put(shm_t * shm) {
+    u32 key = irq_spin_take(&shm_lock);
+    dbg_assert(shm->refs > 0);
+    if (0 != --shm->refs) {
+        irq_spin_give(&shm_lock, key);
+        return;
+    }
+    if ('\0' != shm->name[0]) {
+        dl_remove(&shm_list, &shm->dl);
+    }
+    irq_spin_give(&shm_lock, key);
+
+    pglist_free_all(&shm->pages);
+    pool_obj_free(&shm_pool, shm);
+}
+
+__INIT void shm_lib_init() {
+    pool_init(&shm_pool, sizeof(shm_t));
+}
@@ -2,20 +2,277 @@
 
 static pool_t range_pool;
 
+// ranges no smaller than this are aligned, so they can use 2M mappings
+#define HUGE_SIZE   (PAGE_SIZE << 9)
+#define FAULT_HUGE  1   // fault needs a 2M block allocated without lock
+#define FAULT_AGAIN 2   // fault must wait for pending TLB flush
+
+// work left until the lock is given back. TLB is flushed first, then pages
+// are freed, so no cpu waits for shootdown with the lock held, and no cpu
+// could reach freed pages through stale TLB entries
+typedef struct vmdefer {
+    mmu_batch_t batch;
+    pglist_t    pages;          // private pages to free
+    pfn_t *     shared;         // shared pages to put, kmalloc'ed array
+    usize       shared_count;
+    pfn_t       cow;            // shared page replaced by its copy, to put
+    shm_t *     shm;            // shared memory object to put
+} vmdefer_t;
+
+#define VMDEFER_INIT ((vmdefer_t) { .batch = MMU_BATCH_INIT, \
+    .pages = PGLIST_INIT, .shared = NULL, .shared_count = 0,   \
+    .cow = NO_PAGE, .shm = NULL })
+
+// all ranges, both free and used, are indexed by address in a rbtree.
+// each node also records the size of largest free range in its subtree,
+// so searching for a free range that fits takes O(log n).
+//
+// pages in `range->pages` are private to the range. after fork, pages are
+// shared read-only by both spaces, they are not in any list but found by
+// page table walk, and freed when the last mapping is gone.
+//
+// pages of shared memory objects belong to the object, ranges mapping
+// them hold a reference, and never own those pages.
+
+#define RANGE(node) PARENT(node, vmrange_t, rb)
+
+static void range_augment(rbnode_t * rb) {
+    vmrange_t * range = RANGE(rb);
+    usize       max   = (RT_FREE == range->type) ? range->size : 0;
+    if (NULL != rb->left) {
+        max = MAX(max, RANGE(rb->left)->max_free);
+    }
+    if (NULL != rb->right) {
+        max = MAX(max, RANGE(rb->right)->max_free);
+    }
+    range->max_free = max;
+}
+
+// page table attributes of pages in this range
+static u32 range_attr(vmrange_t * range) {
+    u32 attr = 0;
+    if (0 != (range->flags & VM_RDONLY))   { attr |= MMU_RDONLY; }
+    if (0 != (range->flags & VM_NOEXEC))   { attr |= MMU_NOEXEC; }
+    if (0 != (range->flags & VM_NOACCESS)) { attr |= MMU_KERNEL; }
+    if ((NULL != range->shm) && (0 != (range->shm->flags & SHM_RDONLY))) {
+        attr |= MMU_RDONLY;
+    }
+    return attr;
+}
+
+static vmrange_t * range_create(usize addr, usize size, u32 type) {
+    vmrange_t * range = (vmrange_t *) pool_obj_alloc(&range_pool);
+    range->rb       = RBNODE_INIT;
+    range->addr     = addr;
+    range->size     = size;
+    range->type     = type;
+    range->max_free = 0;
+    range->flags    = 0;
+    range->pages    = PGLIST_INIT;
+    range->shm      = NULL;
+    return range;
+}
+
+// add range into the tree, caller makes sure no overlap
+static void range_insert(vmspace_t * space, vmrange_t * range) {
+    rbnode_t ** link   = &space->ranges.root;
+    rbnode_t *  parent = NULL;
+    while (NULL != *link) {
+        parent = *link;
+        if (range->addr < RANGE(parent)->addr) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+    rb_link_node(&range->rb, parent, link);
+    rb_insert_fixup(&space->ranges, &range->rb);
+}
+
+// remove range from the tree and free the node
+static void range_delete(vmspace_t * space, vmrange_t * range) {
+    rb_erase(&space->ranges, &range->rb);
+    pool_obj_free(&range_pool, range);
+}
+
+// range size or type changed, update max free size along the path
+static void range_update(vmspace_t * space, vmrange_t * range) {
+    rb_augment_path(&space->ranges, &range->rb);
+}
+
+static vmrange_t * range_prev(vmrange_t * range) {
+    rbnode_t * rb = rb_prev(&range->rb);
+    return (NULL == rb) ? NULL : RANGE(rb);
+}
+
+static vmrange_t * range_next(vmrange_t * range) {
+    rbnode_t * rb = rb_next(&range->rb);
+    return (NULL == rb) ? NULL : RANGE(rb);
+}
+
+// find the first range ends after `addr`, either containing `addr`
+// or the first range after it. return NULL if no such range
+static vmrange_t * range_lookup(vmspace_t * space, usize addr) {
+    vmrange_t * found = NULL;
+    rbnode_t *  rb    = space->ranges.root;
+    while (NULL != rb) {
+        vmrange_t * range = RANGE(rb);
+        if (addr < range->addr + range->size) {
+            found = range;
+            rb    = rb->left;
+        } else {
+            rb    = rb->right;
+        }
+    }
+    return found;
+}
+
+// find the free range with lowest address, no smaller than `size`
+static vmrange_t * range_find_free(vmspace_t * space, usize size) {
+    rbnode_t * rb = space->ranges.root;
+    while ((NULL != rb) && (RANGE(rb)->max_free >= size)) {
+        vmrange_t * range = RANGE(rb);
+        if ((NULL != rb->left) && (RANGE(rb->left)->max_free >= size)) {
+            rb = rb->left;
+        } else if ((RT_FREE == range->type) && (range->size >= size)) {
+            return range;
+        } else {
+            rb = rb->right;
+        }
+    }
+    return NULL;
+}
+
+// take [addr, addr+size) out of free range, mark it as used and return
+// the space before and after the allocated range
+static vmrange_t * range_carve(vmspace_t * space, vmrange_t * range,
+                               usize addr, usize size) {
+    usize end = range->addr + range->size;
+    if (addr + size < end) {
+        range_insert(space, range_create(addr + size, end - addr - size, RT_FREE));
+    }
+    if (range->addr < addr) {
+        range->size = addr - range->addr;
+        range_update(space, range);
+        range = range_create(addr, size, RT_USED);
+        range_insert(space, range);
+    } else {
+        range->size = size;
+        range->type = RT_USED;
+        range_update(space, range);
+    }
+    return range;
+}
+
+//------------------------------------------------------------------------------
+// pages freed after TLB flush
+
+// drop one reference to a shared page, free it if it's the last one
+static void shared_page_put(pfn_t page) {
+    dbg_assert(PT_SHARED == page_array[page].type);
+    if (1 == atomic32_dec(&page_array[page].refs)) {
+        page_block_free(page, 0);
+    }
+}
+
+// collect shared pages mapped in [addr, end) into an array, so their
+// references could be dropped after unmap and TLB flush. other spaces may
+// unmap the same pages at the same time, so page links cannot be used
+// return ERROR if no memory for the array. lock should be held by caller
+static int range_shared(vmspace_t * space, usize addr, usize end,
+                        pfn_t ** pages, usize * count) {
+    usize n = 0;
+    for (usize va = addr; va < end; va += PAGE_SIZE) {
+        usize pa = mmu_translate(space->ctx, va);
+        if ((NO_ADDR != pa) && (PT_SHARED == page_array[pa >> PAGE_SHIFT].type)) {
+            ++n;
+        }
+    }
+
+    * pages = NULL;
+    * count = n;
+    if (0 == n) {
+        return OK;
+    }
+
+    * pages = (pfn_t *) kmalloc(n * sizeof(pfn_t));
+    if (NULL == * pages) {
+        return ERROR;
+    }
+
+    n = 0;
+    for (usize va = addr; va < end; va += PAGE_SIZE) {
+        usize pa = mmu_translate(space->ctx, va);
+        if ((NO_ADDR != pa) && (PT_SHARED == page_array[pa >> PAGE_SHIFT].type)) {
+            (* pages)[n++] = (pfn_t) (pa >> PAGE_SHIFT);
+        }
+    }
+    return OK;
+}
+
+// drop references collected by `range_shared`, after TLB flush
+static void shared_pages_put(pfn_t * pages, usize count) {
+    for (usize i = 0; i < count; ++i) {
+        shared_page_put(pages[i]);
+    }
+    if (NULL != pages) {
+        kfree(pages);
+    }
+}
+
+// flush TLB entries of `ctx` collected in `defer`, then free pages
+static void defer_run(usize ctx, vmdefer_t * defer) {
+    mmu_flush(ctx, &defer->batch);
+    pglist_free_all(&defer->pages);
+    shared_pages_put(defer->shared, defer->shared_count);
+    if (NO_PAGE != defer->cow) {
+        shared_page_put(defer->cow);
+    }
+    if (NULL != defer->shm) {
+        shm_put(defer->shm);
+    }
+}
+
+// give back the lock, then finish work left in `defer`
+// stale entries are counted as pending until all cpus have flushed
+static void space_give(vmspace_t * space, u32 key, vmdefer_t * defer) {
+    int pending = (0 != defer->batch.count);
+    if (pending) {
+        atomic32_inc(&space->unflushed);
+    }
+    irq_spin_give(&space->lock, key);
+    defer_run(space->ctx, defer);
+    if (pending) {
+        atomic32_dec(&space->unflushed);
+    }
+}
+
+//------------------------------------------------------------------------------
+// virtual memory space operations
+
 void vmspace_init(vmspace_t * space) {
     space->lock   = SPIN_INIT;
     space->ctx    = mmu_ctx_create();
-    space->ranges = DLLIST_INIT;
-    vmspace_add_free(space, USER_START, USER_END - USER_START);
+    space->ranges = RBTREE_INIT;
+    space->ranges.augment = range_augment;
+    space->faults = 0;
+    space->unflushed = 0;
+    space->brk_base = NO_ADDR;
+    space->brk      = NO_ADDR;
+
+    // first page is never given out, so address 0 always means NULL
+    vmspace_add_free(space, USER_START + PAGE_SIZE, USER_END - USER_START - PAGE_SIZE);
 }
 
 void vmspace_destroy(vmspace_t * space) {
-    dlnode_t * dl;
-    while (NULL != (dl = dl_pop_head(&space->ranges))) {
-        vmrange_t * range = PARENT(dl, vmrange_t, dl);
+    rbnode_t * rb;
+    while (NULL != (rb = space->ranges.root)) {
+        vmrange_t * range = RANGE(rb);
         vmspace_unmap(space, range);
-        pool_obj_free(&range_pool, range);
+        range_delete(space, range);
     }
+    mmu_ctx_destroy(space->ctx);
+    space->ctx = 0;
 }
 
 // add a new region into the virtual memory space, and mark as free
@@ -25,23 +282,21 @@ int vmspace_add_free(vmspace_t * space, usize addr, usize size) {
 
     u32 key = irq_spin_take(&space->lock);
 
-    // search addr_list, looking for the first range after the new region
-    dlnode_t  * dl   = space->ranges.head;
-    vmrange_t * prev = NULL;
-    vmrange_t * next = NULL;
-    for (; NULL != dl; dl = dl->next) {
-        next = PARENT(dl, vmrange_t, dl);
-        if (addr + size <= next->addr) {
-            // this is the next range
-            break;
-        }
-        if (next->addr + next->size > addr) {
-            // overlap with existing range
-            irq_spin_give(&space->lock, key);
-            return ERROR;
-        }
-        prev = next;
-        next = NULL;
+    // look for the first range after the new region
+    vmrange_t * next = range_lookup(space, addr);
+    if ((NULL != next) && (next->addr < addr + size)) {
+        // overlap with existing range
+        irq_spin_give(&space->lock, key);
+        return ERROR;
+    }
+
+    vmrange_t * prev;
+    if (NULL != next) {
+        prev = range_prev(next);
+    } else if (NULL != space->ranges.root) {
+        prev = RANGE(rb_last(&space->ranges));
+    } else {
+        prev = NULL;
     }
 
     vmrange_t * range = NULL;
@@ -59,9 +314,8 @@ int vmspace_add_free(vmspace_t * space, usize addr, usize size) {
         (RT_FREE == next->type)) {
         // merge with next range
         if (NULL != range) {
-            range->size += range->size;
-            dl_remove(&space->ranges, &next->dl);
-            pool_obj_free(&range_pool, next);
+            range->size += next->size;
+            range_delete(space, next);
         } else {
             range = next;
             range->addr = addr;
@@ -70,14 +324,10 @@ int vmspace_add_free(vmspace_t * space, usize addr, usize size) {
     }
 
     if (NULL == range) {
-        // cannot merge, create new node and insert before `next`
-        range = (vmrange_t *) pool_obj_alloc(&range_pool);
-        range->dl    = DLNODE_INIT;
-        range->addr  = addr;
-        range->size  = size;
-        range->type  = RT_FREE;
-        range->pages = PGLIST_INIT;
-        dl_insert_before(&space->ranges, &range->dl, dl);
+        // cannot merge, create new node
+        range_insert(space, range_create(addr, size, RT_FREE));
+    } else {
+        range_update(space, range);
     }
 
     irq_spin_give(&space->lock, key);
@@ -91,232 +341,813 @@ int vmspace_add_used(vmspace_t * space, usize addr, usize size) {
 
     u32 key = irq_spin_take(&space->lock);
 
-    // search addr_list, looking for the first range after the new resion
-    dlnode_t  * dl   = space->ranges.head;
-    for (; NULL != dl; dl = dl->next) {
-        vmrange_t * next = PARENT(dl, vmrange_t, dl);
-        if (addr + size <= next->addr) {
-            // this is the next range
-            break;
-        }
-        if (next->addr + next->size > addr) {
-            // overlap with existing range
-            irq_spin_give(&space->lock, key);
-            return ERROR;
-        }
+    vmrange_t * next = range_lookup(space, addr);
+    if ((NULL != next) && (next->addr < addr + size)) {
+        // overlap with existing range
+        irq_spin_give(&space->lock, key);
+        return ERROR;
     }
 
     // used ranges cannot merge
-    vmrange_t * range = (vmrange_t *) pool_obj_alloc(&range_pool);
-    range->dl    = DLNODE_INIT;
-    range->addr  = addr;
-    range->size  = size;
-    range->type  = RT_USED;
-    range->pages = PGLIST_INIT;
-    dl_insert_before(&space->ranges, &range->dl, dl);
+    range_insert(space, range_create(addr, size, RT_USED));
 
     irq_spin_give(&space->lock, key);
     return OK;
 }
 
+// return the free range containing [addr, addr+size), or NULL
+// lock should be held by caller
+static vmrange_t * find_free_at(vmspace_t * space, usize addr, usize size) {
+    vmrange_t * range = range_lookup(space, addr);
+    if ((NULL == range) ||
+        (RT_FREE != range->type) ||
+        (range->addr > addr) ||
+        (addr + size > range->addr + range->size)) {
+        return NULL;
+    }
+    return range;
+}
+
+// search for the free range with lowest address that could hold `size`
+// large ranges are aligned to 2M, so they could be backed by 2M pages
+// if no free range could hold an aligned one, fall back to any address
 vmrange_t * vmspace_alloc(vmspace_t * space, usize size) {
     dbg_assert((size & (PAGE_SIZE - 1)) == 0);
 
-    u32 key = irq_spin_take(&space->lock);
-
-    // search for the smallest free range that is large enough
-    usize       min_size  = (usize) -1;
-    vmrange_t * min_range = NULL;
-    for (dlnode_t * dl = space->ranges.head; NULL != dl; dl = dl->next) {
-        vmrange_t * range = PARENT(dl, vmrange_t, dl);
-        if ((RT_FREE != range->type) ||
-            (size     > range->size)) {
-            continue;
+    u32         key   = irq_spin_take(&space->lock);
+    usize       addr  = 0;
+    vmrange_t * range = NULL;
+    if (size >= HUGE_SIZE) {
+        // any range this large holds an aligned one
+        range = range_find_free(space, size + HUGE_SIZE - PAGE_SIZE);
+        if (NULL != range) {
+            addr = ROUND_UP(range->addr, HUGE_SIZE);
         }
-
-        if (range->size < min_size) {
-            min_size  = range->size;
-            min_range = range;
+    }
+    if (NULL == range) {
+        range = range_find_free(space, size);
+        if (NULL != range) {
+            addr = range->addr;
         }
     }
 
-    if (NULL == min_range) {
-        irq_spin_give(&space->lock, key);
-        return NULL;
+    if (NULL != range) {
+        range = range_carve(space, range, addr, size);
+    }
+
+    irq_spin_give(&space->lock, key);
+    return range;
+}
+
+vmrange_t * vmspace_alloc_at(vmspace_t * space, usize addr, usize size) {
+    dbg_assert((addr & (PAGE_SIZE - 1)) == 0);
+    dbg_assert((size & (PAGE_SIZE - 1)) == 0);
+
+    u32         key   = irq_spin_take(&space->lock);
+    vmrange_t * range = find_free_at(space, addr, size);
+    if (NULL != range) {
+        range = range_carve(space, range, addr, size);
     }
 
-    if (min_range->size > size) {
-        vmrange_t * rest = (vmrange_t *) pool_obj_alloc(&range_pool);
-        rest->dl    = DLNODE_INIT;
-        rest->addr  = min_range->addr + min_range->size;
-        rest->size  = min_range->size - size;
-        rest->type  = RT_FREE;
-        rest->pages = PGLIST_INIT;
-        dl_insert_after(&space->ranges, &rest->dl, &min_range->dl);
+    irq_spin_give(&space->lock, key);
+    return range;
+}
+
+// mark used range as free, merge with free neighbours
+// lock should be held by caller
+static void range_release(vmspace_t * space, vmrange_t * range) {
+    range->type  = RT_FREE;
+    range->flags = 0;
+
+    vmrange_t * prev = range_prev(range);
+    if ((NULL        != prev)        &&
+        (RT_FREE     == prev->type)  &&
+        (range->addr == prev->addr + prev->size)) {
+        range->addr  = prev->addr;
+        range->size += prev->size;
+        range_delete(space, prev);
     }
 
-    min_range->size = size;
-    min_range->type = RT_USED;
+    vmrange_t * next = range_next(range);
+    if ((NULL       != next)         &&
+        (RT_FREE    == next->type)   &&
+        (next->addr == range->addr + range->size)) {
+        range->size += next->size;
+        range_delete(space, next);
+    }
 
+    range_update(space, range);
+}
+
+void vmspace_free(vmspace_t * space, vmrange_t * range) {
+    dbg_assert(RT_USED == range->type);
+
+    u32 key = irq_spin_take(&space->lock);
+    range_release(space, range);
     irq_spin_give(&space->lock, key);
-    return min_range;
 }
 
-vmrange_t * vmspace_alloc_at(vmspace_t * space, usize addr, usize size) {
+// check whether the given range is free
+int vmspace_is_free(vmspace_t * space, usize addr, usize size) {
     dbg_assert((addr & (PAGE_SIZE - 1)) == 0);
     dbg_assert((size & (PAGE_SIZE - 1)) == 0);
 
-    u32   key = irq_spin_take(&space->lock);
-    usize end = addr + size;
+    u32 key = irq_spin_take(&space->lock);
+    int ret = (NULL != find_free_at(space, addr, size)) ? YES : NO;
+    irq_spin_give(&space->lock, key);
+    return ret;
+}
 
-    for (dlnode_t * dl = space->ranges.head; NULL != dl; dl = dl->next) {
-        vmrange_t * range = PARENT(dl, vmrange_t, dl);
-        if ((RT_FREE != range->type) ||
-            (end > range->addr + range->size)) {
-            continue;
+// reorder blocks in the list by order, largest first
+static void sort_blocks(pglist_t * list) {
+    pglist_t orders[ORDER_COUNT];
+    for (int i = 0; i < ORDER_COUNT; ++i) {
+        orders[i] = PGLIST_INIT;
+    }
+
+    pfn_t blk;
+    while (NO_PAGE != (blk = pglist_pop_head(list))) {
+        pglist_push_tail(&orders[page_array[blk].order], blk);
+    }
+    for (int i = ORDER_COUNT - 1; i >= 0; --i) {
+        while (NO_PAGE != (blk = pglist_pop_head(&orders[i]))) {
+            pglist_push_tail(list, blk);
         }
+    }
+}
 
-        if (range->addr > addr) {
-            // already passed the end, so target range is not free
-            break;
+// populate the first `size` bytes of the range, rest is demand paged
+// `flags` are added to the range under lock, before pages are mapped
+static int range_populate(vmspace_t * space, vmrange_t * range, usize size, u32 flags) {
+    dbg_assert(RT_USED == range->type);
+    dbg_assert(NO_PAGE == range->pages.head);
+    dbg_assert(NO_PAGE == range->pages.tail);
+    dbg_assert(size <= range->size);
+
+    vmdefer_t defer      = VMDEFER_INIT;
+    u32       key        = irq_spin_take(&space->lock);
+    usize     page_count = ROUND_UP(size, PAGE_SIZE) >> PAGE_SHIFT;
+
+    range->flags |= VM_DEMAND | flags;
+    if (0 == page_count) {
+        irq_spin_give(&space->lock, key);
+        return OK;
+    }
+
+    // allocate all pages at once, in as few blocks as possible
+    // user pages must be cleared, so old content won't leak
+    if (OK != page_list_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, page_count, &range->pages)) {
+        irq_spin_give(&space->lock, key);
+        return ERROR;
+    }
+
+    // put large blocks first, so they land on 2M aligned addresses
+    // and could be mapped using 2M pages
+    sort_blocks(&range->pages);
+
+    // map each block, blocks are placed in address order
+    usize va = range->addr;
+    for (pfn_t blk = range->pages.head; NO_PAGE != blk; blk = page_array[blk].next) {
+        usize n  = 1UL << page_array[blk].order;
+        usize pa = (usize) blk << PAGE_SHIFT;
+        if (OK != mmu_map(space->ctx, va, pa, n, range_attr(range), &defer.batch)) {
+            // no page for page table, undo blocks mapped so far
+            mmu_unmap(space->ctx, range->addr, (va - range->addr) >> PAGE_SHIFT, &defer.batch);
+            defer.pages  = range->pages;
+            range->pages = PGLIST_INIT;
+            space_give(space, key, &defer);
+            return ERROR;
+        }
+        va += n << PAGE_SHIFT;
+    }
+
+    space_give(space, key, &defer);
+    return OK;
+}
+
+// reserve the range for demand paging, pages are allocated on first touch
+// range flags are set together with VM_DEMAND, while lock is held
+int vmspace_map(vmspace_t * space, vmrange_t * range, u32 flags) {
+    return range_populate(space, range, 0, flags);
+}
+
+// populate the first `size` bytes of the range, rest is demand paged
+// pages list of populated part is in address order
+int vmspace_populate(vmspace_t * space, vmrange_t * range, usize size) {
+    return range_populate(space, range, size, 0);
+}
+
+// map all pages of the shared memory object into the range
+// range takes over the reference held by caller, unless failed
+// lock should be held by caller
+static int range_map_shm(vmspace_t * space, vmrange_t * range, shm_t * shm,
+                         vmdefer_t * defer) {
+    dbg_assert(RT_USED == range->type);
+    dbg_assert(NULL == range->shm);
+    dbg_assert(range->size == shm->size);
+
+    range->shm = shm;
+
+    usize va = range->addr;
+    for (pfn_t blk = shm->pages.head; NO_PAGE != blk; blk = page_array[blk].next) {
+        usize n  = 1UL << page_array[blk].order;
+        usize pa = (usize) blk << PAGE_SHIFT;
+        if (OK != mmu_map(space->ctx, va, pa, n, range_attr(range), &defer->batch)) {
+            mmu_unmap(space->ctx, range->addr, (va - range->addr) >> PAGE_SHIFT, &defer->batch);
+            range->shm = NULL;
+            return ERROR;
         }
+        va += n << PAGE_SHIFT;
+    }
+
+    range->flags |= VM_SHM;
+    return OK;
+}
+
+int vmspace_map_shm(vmspace_t * space, vmrange_t * range, shm_t * shm) {
+    vmdefer_t defer = VMDEFER_INIT;
+    u32       key   = irq_spin_take(&space->lock);
+    int       ret   = range_map_shm(space, range, shm, &defer);
+    space_give(space, key, &defer);
+    return ret;
+}
+
+// remove mappings of the range, pages are moved to `defer`, and freed
+// after TLB flush. lock should be held by caller
+static int range_unmap(vmspace_t * space, vmrange_t * range, vmdefer_t * defer) {
+    dbg_assert(NULL    == defer->shared);
+    dbg_assert(NULL    == defer->shm);
+    dbg_assert(NO_PAGE == defer->pages.head);
+
+    if (RT_USED != range->type) {
+        return OK;
+    }
+
+    // shared pages are only known from page table, collect them before
+    // unmap, references are dropped after TLB flush
+    if ((0 != (range->flags & VM_SHARED)) &&
+        (OK != range_shared(space, range->addr, range->addr + range->size,
+                            &defer->shared, &defer->shared_count))) {
+        return ERROR;
+    }
+
+    int page_count = range->size >> PAGE_SHIFT;
+    if (OK != mmu_unmap(space->ctx, range->addr, page_count, &defer->batch)) {
+        kfree(defer->shared);
+        defer->shared       = NULL;
+        defer->shared_count = 0;
+        return ERROR;
+    }
 
-        // we've found a valid range, return extra space
-        if (range->addr < addr) {
-            vmrange_t * prev = (vmrange_t *) pool_obj_alloc(&range_pool);
-            prev->dl    = DLNODE_INIT;
-            prev->addr  = range->addr;
-            prev->size  = addr - range->addr;
-            prev->type  = RT_FREE;
-            prev->pages = PGLIST_INIT;
-            dl_insert_before(&space->ranges, &prev->dl, dl);
+    // pages of shared memory object are freed with the last mapping
+    defer->shm   = range->shm;
+    defer->pages = range->pages;
+    range->shm   = NULL;
+    range->pages = PGLIST_INIT;
+    range->flags &= ~(VM_DEMAND | VM_SHARED | VM_SHM);
+    return OK;
+}
+
+int vmspace_unmap(vmspace_t * space, vmrange_t * range) {
+    vmdefer_t defer = VMDEFER_INIT;
+    u32       key   = irq_spin_take(&space->lock);
+    int       ret   = range_unmap(space, range, &defer);
+    space_give(space, key, &defer);
+    return ret;
+}
+
+// write to a shared page, copy it unless we are the last one using it
+// lock should be held by caller
+static int shared_page_write(vmspace_t * space, vmrange_t * range,
+                             usize va, pfn_t page, vmdefer_t * defer) {
+    if (1 == atomic32_get(&page_array[page].refs)) {
+        // other spaces are gone, take it as a private page
+        if (OK != mmu_map(space->ctx, va, (usize) page << PAGE_SHIFT, 1,
+                          range_attr(range), &defer->batch)) {
+            return ERROR;
         }
+        page_array[page].type = PT_KERNEL;
+        pglist_push_tail(&range->pages, page);
+        return OK;
+    }
+
+    pfn_t copy = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
+    if (NO_PAGE == copy) {
+        return ERROR;
+    }
 
-        if (end < range->addr + range->size) {
-            vmrange_t * next = (vmrange_t *) pool_obj_alloc(&range_pool);
-            next->dl    = DLNODE_INIT;
-            next->addr  = end;
-            next->size  = range->addr + range->size - end;
-            next->type  = RT_FREE;
-            next->pages = PGLIST_INIT;
-            dl_insert_after(&space->ranges, &next->dl, dl);
+    memcpy(phys_to_virt((usize) copy << PAGE_SHIFT),
+           phys_to_virt((usize) page << PAGE_SHIFT), PAGE_SIZE);
+    if (OK != mmu_map(space->ctx, va, (usize) copy << PAGE_SHIFT, 1,
+                      range_attr(range), &defer->batch)) {
+        page_block_free(copy, 0);
+        return ERROR;
+    }
+    pglist_push_tail(&range->pages, copy);
+    defer->cow = page;
+    return OK;
+}
+
+// page fault inside a range reserved by `vmspace_map`, allocate and map a
+// page if not present, or copy the shared page on write. lock should be
+// held by caller. 2M block is never allocated here, if `* blk` is not
+// prepared but a 2M page fits, return FAULT_HUGE to get one without lock.
+// `* blk` is set to NO_PAGE once it is mapped
+static int fault_locked(vmspace_t * space, usize va, int write,
+                        pfn_t * blk, int huge, vmdefer_t * defer) {
+    vmrange_t * range = range_lookup(space, va);
+    if ((NULL    == range)       ||
+        (RT_USED != range->type) ||
+        (range->addr > va)       ||
+        (0 == (range->flags & VM_DEMAND)) ||
+        (0 != (range->flags & VM_NOACCESS)) ||
+        (write && (0 != (range->flags & VM_RDONLY)))) {
+        return ERROR;
+    }
+
+    // heap pages above the break are not usable
+    usize limit = range->addr + range->size;
+    if (0 != (range->flags & VM_HEAP)) {
+        limit = ROUND_UP(space->brk, PAGE_SIZE);
+    }
+    if (va >= limit) {
+        return ERROR;
+    }
+
+    // another thread may have populated or copied this page
+    usize pa = mmu_translate(space->ctx, va);
+    if (NO_ADDR != pa) {
+        int   ret  = OK;
+        pfn_t page = (pfn_t) (pa >> PAGE_SHIFT);
+        if (write && (PT_SHARED == page_array[page].type)) {
+            // after fork, threads on other cpus could still write this page
+            // through stale entries, until the flush is done
+            if (0 != atomic32_get(&space->unflushed)) {
+                return FAULT_AGAIN;
+            }
+            ret = shared_page_write(space, range, va, page, defer);
+            ++space->faults;
+        } else if (write) {
+            // private page write protected by `vmspace_protect`
+            ret = mmu_protect(space->ctx, va, 1, range_attr(range), &defer->batch);
         }
+        return ret;
+    }
 
-        range->addr= addr;
-        range->size = size;
-        range->type = RT_USED;
+    // with VM_HUGE, back the whole 2M window with a 2M page if it lies
+    // inside the range and nothing is mapped there yet. the block is broken
+    // into single pages in the list, so ranges could still be split and shared
+    usize va_2m = ROUND_DOWN(va, HUGE_SIZE);
+    if (huge &&
+        (0 != (range->flags & VM_HUGE)) &&
+        (range->addr <= va_2m) &&
+        (va_2m + HUGE_SIZE <= limit) &&
+        (YES == mmu_is_empty(space->ctx, va_2m, HUGE_SIZE >> PAGE_SHIFT))) {
+        if (NO_PAGE == * blk) {
+            return FAULT_HUGE;
+        }
+        if (OK == mmu_map(space->ctx, va_2m, (usize) * blk << PAGE_SHIFT, 512,
+                          range_attr(range), &defer->batch)) {
+            for (pfn_t i = 0; i < 512; ++i) {
+                page_array[* blk + i].block = 1;
+                page_array[* blk + i].order = 0;
+                pglist_push_tail(&range->pages, * blk + i);
+            }
+            * blk = NO_PAGE;
+            ++space->faults;
+            return OK;
+        }
+    }
 
-        irq_spin_give(&space->lock, key);
-        return range;
+    pfn_t page = page_block_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, 0);
+    if ((NO_PAGE != page) &&
+        (OK != mmu_map(space->ctx, va, (usize) page << PAGE_SHIFT, 1,
+                       range_attr(range), &defer->batch))) {
+        page_block_free(page, 0);
+        page = NO_PAGE;
+    }
+    if (NO_PAGE == page) {
+        return ERROR;
+    }
+
+    pglist_push_tail(&range->pages, page);
+    ++space->faults;
+    return OK;
+}
+
+int vmspace_fault(vmspace_t * space, usize va, int write) {
+    pfn_t blk  = NO_PAGE;
+    int   huge = YES;
+    int   ret;
+
+    va = ROUND_DOWN(va, PAGE_SIZE);
+    while (1) {
+        vmdefer_t defer = VMDEFER_INIT;
+        u32       key   = irq_spin_take(&space->lock);
+        ret = fault_locked(space, va, write, &blk, huge, &defer);
+        space_give(space, key, &defer);
+        if (FAULT_AGAIN == ret) {
+            cpu_relax();
+            continue;
+        }
+        if (FAULT_HUGE != ret) {
+            break;
+        }
+
+        // 2M block is allocated without lock, the range may change
+        // meanwhile, so everything is checked again after retaking it
+        blk  = page_block_alloc(ZONE_DMA|ZONE_NORMAL|ZONE_ZERO, 9);
+        huge = (NO_PAGE != blk);
+    }
+
+    // block not used, range changed or 2M page no longer fits
+    if (NO_PAGE != blk) {
+        page_block_free(blk, 9);
     }
+    return ret;
+}
 
+// return the used range containing `va`, or NULL
+vmrange_t * vmspace_find(vmspace_t * space, usize va) {
+    u32         key   = irq_spin_take(&space->lock);
+    vmrange_t * range = range_lookup(space, va);
+    if ((NULL != range) &&
+        ((RT_USED != range->type) || (range->addr > va))) {
+        range = NULL;
+    }
     irq_spin_give(&space->lock, key);
-    return NULL;
+    return range;
 }
 
-void vmspace_free(vmspace_t * space, vmrange_t * range) {
-    dbg_assert(RT_USED == range->type);
+// map a run of shared pages into `dst`, taking a reference only once mapped
+static int range_share_run(vmspace_t * dst, usize va, usize pa, usize n, u32 attr,
+                           mmu_batch_t * batch) {
+    if (OK != mmu_map(dst->ctx, va, pa, n, attr, batch)) {
+        return ERROR;
+    }
+    for (usize i = 0; i < n; ++i) {
+        atomic32_inc(&page_array[(pa >> PAGE_SHIFT) + i].refs);
+    }
+    return OK;
+}
 
-    u32 key = irq_spin_take(&space->lock);
+// share all pages of `from` with `to`, both mapped read-only
+// private blocks are split into single pages, each with its own refcount
+static int range_share(vmspace_t * src, vmrange_t * from, mmu_batch_t * src_batch,
+                       vmspace_t * dst, vmrange_t * to,   mmu_batch_t * dst_batch) {
+    // write protect the whole source range with a single TLB flush, so
+    // threads of `src` on other cpus no longer write these pages
+    u32   attr = range_attr(from) | MMU_RDONLY;
+    usize end  = from->addr + from->size;
+    if (OK != mmu_protect(src->ctx, from->addr, from->size >> PAGE_SHIFT, attr, src_batch)) {
+        return ERROR;
+    }
+
+    pfn_t blk;
+    while (NO_PAGE != (blk = pglist_pop_head(&from->pages))) {
+        pfn_t n = 1U << page_array[blk].order;
+        for (pfn_t i = 0; i < n; ++i) {
+            page_array[blk + i].type  = PT_SHARED;
+            page_array[blk + i].block = 1;
+            page_array[blk + i].order = 0;
+            page_array[blk + i].refs  = 1;
+        }
+    }
+    from->flags |= VM_SHARED;
+    to->flags   |= VM_SHARED;
+
+    // map present pages into `dst`, physically continuous runs at once
+    usize run_va = 0;
+    usize run_pa = 0;
+    usize run_n  = 0;
+    for (usize va = from->addr; va < end; va += PAGE_SIZE) {
+        usize pa = mmu_translate(src->ctx, va);
+        if ((NO_ADDR != pa) && (0 != run_n) && (pa == run_pa + (run_n << PAGE_SHIFT))) {
+            ++run_n;
+            continue;
+        }
+        if (0 != run_n) {
+            if (OK != range_share_run(dst, run_va, run_pa, run_n, attr, dst_batch)) {
+                return ERROR;
+            }
+            run_n = 0;
+        }
+        if (NO_ADDR != pa) {
+            run_va = va;
+            run_pa = pa;
+            run_n  = 1;
+        }
+    }
+    if (0 != run_n) {
+        return range_share_run(dst, run_va, run_pa, run_n, attr, dst_batch);
+    }
+    return OK;
+}
 
-    range->size = range->size;
-    range->type = RT_FREE;
+// duplicate used ranges of `src` into a newly created `dst`, pages are
+// shared read-only and copied on write fault
+int vmspace_fork(vmspace_t * dst, vmspace_t * src) {
+    vmdefer_t src_defer = VMDEFER_INIT;     // write protected source pages
+    vmdefer_t dst_defer = VMDEFER_INIT;     // `dst` not loaded, only tables
+    int       ret       = OK;
+    u32       key       = irq_spin_take(&src->lock);
+    dst->brk_base = src->brk_base;
+    dst->brk      = src->brk;
+
+    for (rbnode_t * rb = rb_first(&src->ranges); NULL != rb; rb = rb_next(rb)) {
+        vmrange_t * from = RANGE(rb);
+        if (RT_USED != from->type) {
+            continue;
+        }
 
-    if (NULL != range->dl.prev) {
-        vmrange_t * prev = PARENT(range->dl.prev, vmrange_t, dl);
-        if ((RT_FREE     == prev->type) &&
-            (range->addr == prev->addr + (prev->size))) {
-            range->addr  = prev->addr;
-            range->size += prev->size;
-            dl_remove(&space->ranges, &prev->dl);
+        vmrange_t * to = vmspace_alloc_at(dst, from->addr, from->size);
+        if (NULL == to) {
+            ret = ERROR;
+            break;
+        }
+
+        to->flags = from->flags & ~VM_SHM;
+        if (NULL != from->shm) {
+            // shared memory object stays shared, not copy on write
+            shm_hold(from->shm);
+            ret = range_map_shm(dst, to, from->shm, &dst_defer);
+            if (OK != ret) {
+                shm_put(from->shm);
+            }
+        } else if (0 != (from->flags & VM_DEMAND)) {
+            ret = range_share(src, from, &src_defer.batch, dst, to, &dst_defer.batch);
+        }
+        if (OK != ret) {
+            break;
         }
     }
 
-    if (NULL != range->dl.next) {
-        vmrange_t * next = PARENT(range->dl.next, vmrange_t, dl);
-        if ((RT_FREE    == next->type) &&
-            (next->addr == range->addr + range->size)) {
-            range->size += range->size;
-            dl_remove(&space->ranges, &next->dl);
+    // threads of `src` on other cpus no longer write shared pages after this
+    space_give(src, key, &src_defer);
+    defer_run(dst->ctx, &dst_defer);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// anonymous memory mapped by user, could be partially freed or protected
+
+// split a used range at `at`, return the second half
+// pages of ranges created by mmap are all single pages, faulted in
+static vmrange_t * range_split(vmspace_t * space, vmrange_t * range, usize at) {
+    dbg_assert((range->addr < at) && (at < range->addr + range->size));
+    dbg_assert(RT_USED == range->type);
+
+    usize       end  = range->addr + range->size;
+    vmrange_t * tail = range_create(at, end - at, RT_USED);
+    tail->flags = range->flags;
+    range->size = at - range->addr;
+    range_update(space, range);
+    range_insert(space, tail);
+
+    // move private pages of the second half
+    for (usize va = at; va < end; va += PAGE_SIZE) {
+        usize pa   = mmu_translate(space->ctx, va);
+        pfn_t page = (pfn_t) (pa >> PAGE_SHIFT);
+        if ((NO_ADDR == pa) || (PT_SHARED == page_array[page].type)) {
+            continue;
         }
+        dbg_assert(0 == page_array[page].order);
+        pglist_remove(&range->pages, page);
+        pglist_push_tail(&tail->pages, page);
     }
+    return tail;
+}
 
-    irq_spin_give(&space->lock, key);
+// check whether [addr, addr+size) is covered by ranges created by mmap
+// shared memory ranges are never split, so they must be fully covered
+// if `full` is NO, free gaps are allowed. lock should be held by caller
+static int range_is_mmap(vmspace_t * space, usize addr, usize size, int full) {
+    usize end = addr + size;
+    for (usize va = addr; va < end;) {
+        vmrange_t * range = range_lookup(space, va);
+        if ((NULL == range) || (range->addr >= end)) {
+            return !full;
+        }
+        if (RT_USED != range->type) {
+            if (full) {
+                return NO;
+            }
+        } else if (full && (range->addr > va)) {
+            return NO;
+        } else if (NULL != range->shm) {
+            if ((range->addr < addr) || (range->addr + range->size > end)) {
+                return NO;
+            }
+        } else if (0 == (range->flags & VM_MMAP)) {
+            return NO;
+        }
+        va = range->addr + range->size;
+    }
+    return YES;
 }
 
-// check whether the given range is free
-int vmspace_is_free(vmspace_t * space, usize addr, usize size) {
+// unmap and free all mmap ranges within [addr, addr+size)
+// ranges crossing the boundary are split first. each range is flushed and
+// freed after the lock is dropped, before going on with the next one
+int vmspace_free_at(vmspace_t * space, usize addr, usize size) {
     dbg_assert((addr & (PAGE_SIZE - 1)) == 0);
     dbg_assert((size & (PAGE_SIZE - 1)) == 0);
 
-    u32   key = irq_spin_take(&space->lock);
     usize end = addr + size;
+    for (usize va = addr; va < end;) {
+        vmdefer_t defer = VMDEFER_INIT;
+        u32       key   = irq_spin_take(&space->lock);
 
-    for (dlnode_t * dl = space->ranges.head; NULL != dl; dl = dl->next) {
-        vmrange_t * range = PARENT(dl, vmrange_t, dl);
-        if ((RT_FREE != range->type) &&
-            (end > range->addr + range->size)) {
-            continue;
+        // ranges may be changed by other threads while lock is dropped
+        if (YES != range_is_mmap(space, va, end - va, NO)) {
+            irq_spin_give(&space->lock, key);
+            return ERROR;
         }
 
-        if (range->addr > addr) {
-            // already passed the end, so target range is not free
+        vmrange_t * range = range_lookup(space, va);
+        while ((NULL != range) && (range->addr < end) && (RT_USED != range->type)) {
+            range = range_next(range);
+        }
+        if ((NULL == range) || (range->addr >= end)) {
+            irq_spin_give(&space->lock, key);
             break;
         }
 
-        // found a valid range
-        irq_spin_give(&space->lock, key);
-        return YES;
+        if (range->addr < va) {
+            range = range_split(space, range, va);
+        }
+        if (range->addr + range->size > end) {
+            range_split(space, range, end);
+        }
+        va = range->addr + range->size;
+
+        int ret = range_unmap(space, range, &defer);
+        if (OK == ret) {
+            range_release(space, range);
+        }
+        space_give(space, key, &defer);
+        if (OK != ret) {
+            return ERROR;
+        }
     }
 
-    // no such range, or range is not free
-    irq_spin_give(&space->lock, key);
-    return NO;
+    return OK;
 }
 
-int vmspace_map(vmspace_t * space, vmrange_t * range) {
-    dbg_assert(RT_USED == range->type);
-    dbg_assert(NO_PAGE == range->pages.head);
-    dbg_assert(NO_PAGE == range->pages.tail);
+// change protection flags of mmap ranges within [addr, addr+size)
+// `flags` is a combination of VM_RDONLY, VM_NOEXEC and VM_NOACCESS
+int vmspace_protect(vmspace_t * space, usize addr, usize size, u32 flags) {
+    dbg_assert((addr & (PAGE_SIZE - 1)) == 0);
+    dbg_assert((size & (PAGE_SIZE - 1)) == 0);
+
+    vmdefer_t defer = VMDEFER_INIT;
+    u32       key   = irq_spin_take(&space->lock);
+    usize     end   = addr + size;
+    u32       mask  = VM_RDONLY | VM_NOEXEC | VM_NOACCESS;
 
-    u32   key        = irq_spin_take(&space->lock);
-    usize page_count = range->size >> PAGE_SHIFT;
+    // the whole area must be mapped
+    if (YES != range_is_mmap(space, addr, size, YES)) {
+        irq_spin_give(&space->lock, key);
+        return ERROR;
+    }
 
-    for (usize i = 0; i < page_count; ++i) {
-        pfn_t p = page_block_alloc(ZONE_DMA|ZONE_NORMAL, 0);
-        if (NO_PAGE == p) {
-            pglist_free_all(&range->pages);
+    // read-only objects, like shared program text, never become writable
+    for (usize va = addr; (0 == (flags & VM_RDONLY)) && (va < end);) {
+        vmrange_t * range = range_lookup(space, va);
+        if ((NULL != range->shm) && (0 != (range->shm->flags & SHM_RDONLY))) {
             irq_spin_give(&space->lock, key);
             return ERROR;
         }
+        va = range->addr + range->size;
+    }
 
-        page_array[p].block = 1;
-        page_array[p].order = 0;
-        pglist_push_tail(&range->pages, p);
+    for (usize va = addr; va < end;) {
+        vmrange_t * range = range_lookup(space, va);
+        if (range->addr < va) {
+            range = range_split(space, range, va);
+        }
+        if (range->addr + range->size > end) {
+            range_split(space, range, end);
+        }
+        u32 old = range->flags;
+        range->flags = (range->flags & ~mask) | (flags & mask);
 
-        usize va = range->addr + PAGE_SIZE * i;
-        usize pa = (usize) p << PAGE_SHIFT;
-        mmu_map(space->ctx, va, pa, 1, 0);
+        // update present pages in one walk with a single TLB flush
+        // shared pages must stay read-only, so a range that may contain
+        // them is kept read-only, private pages get write access on fault
+        u32 attr = range_attr(range);
+        if (0 != (range->flags & VM_SHARED)) {
+            attr |= MMU_RDONLY;
+        }
+        if (OK != mmu_protect(space->ctx, range->addr, range->size >> PAGE_SHIFT,
+                              attr, &defer.batch)) {
+            range->flags = old;
+            space_give(space, key, &defer);
+            return ERROR;
+        }
+        va = range->addr + range->size;
     }
 
-    irq_spin_give(&space->lock, key);
+    space_give(space, key, &defer);
     return OK;
 }
 
-void vmspace_unmap(vmspace_t * space, vmrange_t * range) {
-    u32 key = irq_spin_take(&space->lock);
+//------------------------------------------------------------------------------
+// heap managed by brk and sbrk
 
-    if (RT_USED != range->type) {
-        irq_spin_give(&space->lock, key);
-        return;
+// unmap pages of the range within [addr, end), the range itself is kept
+// pages are moved to `defer`, and freed after TLB flush. lock should be
+// held by caller
+static int range_discard(vmspace_t * space, vmrange_t * range,
+                         usize addr, usize end, vmdefer_t * defer) {
+    if ((0 != (range->flags & VM_SHARED)) &&
+        (OK != range_shared(space, addr, end, &defer->shared, &defer->shared_count))) {
+        return ERROR;
     }
 
-    int page_count = range->size >> PAGE_SHIFT;
-    mmu_unmap(space->ctx, range->addr, page_count);
+    // shared pages are not in any list
+    for (usize va = addr; va < end; va += PAGE_SIZE) {
+        usize pa   = mmu_translate(space->ctx, va);
+        pfn_t page = (pfn_t) (pa >> PAGE_SHIFT);
+        if ((NO_ADDR != pa) && (PT_SHARED != page_array[page].type)) {
+            pglist_remove(&range->pages, page);
+            pglist_push_tail(&defer->pages, page);
+        }
+    }
 
-    pglist_free_all(&range->pages);
+    if (OK != mmu_unmap(space->ctx, addr, (end - addr) >> PAGE_SHIFT, &defer->batch)) {
+        // pages stay mapped, give private ones back to the range
+        pfn_t page;
+        while (NO_PAGE != (page = pglist_pop_head(&defer->pages))) {
+            pglist_push_tail(&range->pages, page);
+        }
+        kfree(defer->shared);
+        defer->shared       = NULL;
+        defer->shared_count = 0;
+        return ERROR;
+    }
+    return OK;
+}
+
+// reserve heap window at `addr`, so other ranges never take the space
+// the heap grows into. pages below the break are populated on demand
+int vmspace_heap_init(vmspace_t * space, usize addr) {
+    vmrange_t * range = vmspace_alloc_at(space, addr, HEAP_SIZE);
+    if (NULL == range) {
+        return ERROR;
+    }
 
+    u32 key = irq_spin_take(&space->lock);
+    range->flags    = VM_DEMAND | VM_NOEXEC | VM_HEAP;
+    space->brk_base = addr;
+    space->brk      = addr;
     irq_spin_give(&space->lock, key);
+    return OK;
+}
+
+// move program break within heap window, free pages above the new break
+// lock should be held by caller
+static int heap_set(vmspace_t * space, usize brk, vmdefer_t * defer) {
+    if ((NO_ADDR == space->brk_base) ||
+        (brk < space->brk_base) ||
+        (brk > space->brk_base + HEAP_SIZE)) {
+        return ERROR;
+    }
+
+    usize old = ROUND_UP(space->brk, PAGE_SIZE);
+    usize end = ROUND_UP(brk,        PAGE_SIZE);
+    if ((end < old) &&
+        (OK != range_discard(space, range_lookup(space, space->brk_base), end, old, defer))) {
+        return ERROR;
+    }
+    space->brk = brk;
+    return OK;
+}
+
+// set program break, return the new break, or the current one on failure
+usize vmspace_brk(vmspace_t * space, usize brk) {
+    vmdefer_t defer = VMDEFER_INIT;
+    u32       key   = irq_spin_take(&space->lock);
+    heap_set(space, brk, &defer);
+    brk = space->brk;
+    space_give(space, key, &defer);
+    return brk;
+}
+
+// move program break by `incr` bytes
+// return the old break, or NO_ADDR on failure
+usize vmspace_sbrk(vmspace_t * space, ssize incr) {
+    vmdefer_t defer = VMDEFER_INIT;
+    u32       key   = irq_spin_take(&space->lock);
+    usize     old   = space->brk;
+    usize     brk   = old + (usize) incr;
+    if (((incr > 0) && (brk < old)) ||
+        ((incr < 0) && (brk > old)) ||
+        (OK != heap_set(space, brk, &defer))) {
+        old = NO_ADDR;
+    }
+    space_give(space, key, &defer);
+    return old;
 }
 
 __INIT void vmspace_lib_init() {
@@ -10,6 +10,7 @@ extern "C" {
 
 #include <stddef.h>
 #include <stdint.h>
+#include <mman.h>
 
 #define DEFINE_SYSCALL(i, type, name, ...) \
     extern type name (__VA_ARGS__);